@@ -527,7 +527,7 @@ void drawDungeonMap()
 void handleGameLoop()
 {
     // run file game3.c
-    system("gcc game3.c -o game.out -lncurses -lm && ./game.out");
+    system("gcc game3.c -o game.out -lpanel -lncurses -lm -lpthread && ./game.out");
 }
 
 // رسم بازیکن
@@ -1,14 +1,26 @@
 #include <ncurses.h>
+#include <panel.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
 #include <time.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <pthread.h>
 
-// Define WALL constant
-#define WALL '#'
-// ...existing code...
-
+// Naghshe mitavanad az terminal bozorgtar bashad (masalan -DMAP_WIDTH=200)
+#ifndef MAP_WIDTH
 #define MAP_WIDTH 80
+#endif
+#ifndef MAP_HEIGHT
 #define MAP_HEIGHT 24
+#endif
 #define MIN_ROOMS 6
 #define MAX_ROOMS 10
 
@@ -18,7 +30,9 @@
 #define DOOR '+'
 #define CORRIDOR '#'
 #define PILLAR 'O'
-#define WINDOW '='
+#define WINDOW_PANE '=' // not WINDOW: that name is the ncurses window type
+#define STAIRS_DOWN '>'
+#define STAIRS_UP '<'
 
 #define GOLD_ICON '$'
 #define BLACK_GOLD_ICON '%'
@@ -28,6 +42,8 @@
 
 #define FOOD_ICON 'F'
 #define COMMON_FOOD_HEALTH_RESTORE 10
+#define SUPERIOR_FOOD_HEALTH_RESTORE 20
+#define MAGIC_FOOD_HEALTH_RESTORE 30
 
 #define MAX_WEAPON_ITEMS 10
 
@@ -65,17 +81,18 @@ typedef struct
     int defaultQuantity;
     int canStun;
     int permanent;
+    int recoverable; // lands where its flight ends and can be picked up again
 } Weapon;
 
 // Forward declaration for displayMessage
 void displayMessage(const char *message);
 
 Weapon allWeaponTypes[MAX_WEAPON_TYPES] = {
-    {"Mace", WEAPON_ICON_MACE, WEAPON_CATEGORY_MELEE, 5, 0, 1, 1, 0, 1},
-    {"Dagger", WEAPON_ICON_DAGGER, WEAPON_CATEGORY_RANGED, 12, 5, 0, 10, 0, 0},
-    {"Wand", WEAPON_ICON_WAND, WEAPON_CATEGORY_RANGED, 15, 10, 0, 8, 1, 0},
-    {"Arrow", WEAPON_ICON_ARROW, WEAPON_CATEGORY_RANGED, 5, 5, 0, 20, 0, 0},
-    {"Sword", WEAPON_ICON_SWORD, WEAPON_CATEGORY_MELEE, 10, 0, 0, 1, 0, 1}};
+    {"Mace", WEAPON_ICON_MACE, WEAPON_CATEGORY_MELEE, 5, 0, 1, 1, 0, 1, 1},
+    {"Dagger", WEAPON_ICON_DAGGER, WEAPON_CATEGORY_RANGED, 12, 5, 0, 10, 0, 0, 1},
+    {"Wand", WEAPON_ICON_WAND, WEAPON_CATEGORY_RANGED, 15, 10, 0, 8, 1, 0, 0},
+    {"Arrow", WEAPON_ICON_ARROW, WEAPON_CATEGORY_RANGED, 5, 5, 0, 20, 0, 0, 1},
+    {"Sword", WEAPON_ICON_SWORD, WEAPON_CATEGORY_MELEE, 10, 0, 0, 1, 0, 1, 1}};
 
 // ...existing code...
 
@@ -87,6 +104,10 @@ typedef enum
     CORRUPTED_FOOD // ghazaye fased shode
 } FoodType;
 
+// salamati ke har no'e ghaza bar migardanad (ghazaye fased chizi nemidahad)
+const int foodHealthRestore[] = {COMMON_FOOD_HEALTH_RESTORE, SUPERIOR_FOOD_HEALTH_RESTORE,
+                                 MAGIC_FOOD_HEALTH_RESTORE, 0};
+
 typedef struct
 {
     int x, y;          // mokhtasat rooye naghshe
@@ -94,15 +115,300 @@ typedef struct
     int healthRestore; // mizan salamat ke ba masraf be dast miayad
 } Food;
 
-Food foodInventory[MAX_FOOD_ITEMS];
-int foodCount = 0;                        // shomarande mojoodi ghaza
-int weaponCount = 0;                      // shomarande mojoodi aslahe
-Weapon weaponInventory[MAX_WEAPON_ITEMS]; // Define weapon inventory
+_Thread_local Food foodInventory[MAX_FOOD_ITEMS];
+_Thread_local int foodCount = 0;                        // shomarande mojoodi ghaza
+_Thread_local int weaponCount = 0;                      // shomarande mojoodi aslahe
+_Thread_local Weapon weaponInventory[MAX_WEAPON_ITEMS]; // Define weapon inventory
+
+typedef struct
+{
+    WeaponType type;
+    int quantity;
+} PlayerWeaponEntry;
+
+_Thread_local PlayerWeaponEntry playerInventory[MAX_WEAPON_TYPES];
+_Thread_local WeaponType currentWeaponType;
+_Thread_local int lastShotDirection = -1;
 
-int playerGold = 0;
+_Thread_local int playerGold = 0;
+_Thread_local int currentFloor = 1; // 1 is the top floor (see FLOORS)
+bool overworld = false;   // --overworld (see OVERWORLD)
+_Thread_local int worldLeft = 0, worldTop = 0; // world position of map cell (0, 0) there
 
 // dar jayi bala, biron az tabe main ya har tabe digar:
-bool mapRevealed = false;
+_Thread_local bool mapRevealed = false;
+
+//----------------------------------------------------------------------------
+// TILES
+//----------------------------------------------------------------------------
+// The map stores one compact tile id per cell. Everything the game asks
+// about a tile (can I walk here, does it stop arrows, ...) is a single
+// lookup in tileFlags; the glyph is only needed when drawing.
+typedef unsigned char Tile;
+
+typedef enum
+{
+    TILE_ROCK = 0, // fazaye khali beyne otagh ha
+    TILE_FLOOR,
+    TILE_WALL_VERTICAL,
+    TILE_WALL_HORIZONTAL,
+    TILE_DOOR,
+    TILE_CORRIDOR,
+    TILE_PILLAR,
+    TILE_WINDOW,
+    TILE_STAIRS_DOWN,
+    TILE_STAIRS_UP,
+    TILE_COUNT
+} TileId;
+
+#define TF_WALKABLE 0x01
+#define TF_TRANSPARENT 0x02
+#define TF_BLOCKS_PROJECTILE 0x04
+#define TF_DOOR 0x08
+#define TF_WALL 0x10
+#define TF_STAIRS 0x20
+
+static const unsigned char tileFlags[256] = {
+    [TILE_ROCK] = TF_BLOCKS_PROJECTILE,
+    [TILE_FLOOR] = TF_WALKABLE | TF_TRANSPARENT,
+    [TILE_WALL_VERTICAL] = TF_BLOCKS_PROJECTILE | TF_WALL,
+    [TILE_WALL_HORIZONTAL] = TF_BLOCKS_PROJECTILE | TF_WALL,
+    [TILE_DOOR] = TF_WALKABLE | TF_TRANSPARENT | TF_DOOR,
+    [TILE_CORRIDOR] = TF_WALKABLE | TF_TRANSPARENT,
+    [TILE_PILLAR] = TF_WALKABLE | TF_BLOCKS_PROJECTILE,
+    [TILE_WINDOW] = TF_TRANSPARENT | TF_BLOCKS_PROJECTILE | TF_WALL,
+    [TILE_STAIRS_DOWN] = TF_WALKABLE | TF_TRANSPARENT | TF_STAIRS,
+    [TILE_STAIRS_UP] = TF_WALKABLE | TF_TRANSPARENT | TF_STAIRS,
+};
+
+// Colour pairs, set up in main() when the terminal has colours
+#define PAIR_GOLD 1       // talaye adi
+#define PAIR_BLACK_GOLD 2 // talaye siyah
+#define PAIR_ENEMY 3
+#define PAIR_FOOD 4
+
+// Glyph and attributes together, ready to be written as they are. Drawing
+// a coloured cell costs the same as a plain one.
+static const chtype tileCell[256] = {
+    [TILE_ROCK] = ' ',
+    [TILE_FLOOR] = FLOOR,
+    [TILE_WALL_VERTICAL] = WALL_VERTICAL,
+    [TILE_WALL_HORIZONTAL] = WALL_HORIZONTAL,
+    [TILE_DOOR] = DOOR | A_BOLD,
+    [TILE_CORRIDOR] = CORRIDOR,
+    [TILE_PILLAR] = PILLAR,
+    [TILE_WINDOW] = WINDOW_PANE,
+    [TILE_STAIRS_DOWN] = STAIRS_DOWN | A_BOLD,
+    [TILE_STAIRS_UP] = STAIRS_UP | A_BOLD,
+};
+
+#define TILE_HAS(tile, flag) (tileFlags[(tile)] & (flag))
+
+//----------------------------------------------------------------------------
+// CELL SETS
+//----------------------------------------------------------------------------
+// Layers with one bit per cell (what is in view, what was explored, where
+// one can walk), each row kept in 64-bit words. A question about a whole
+// layer is then a few word operations per row instead of a loop over the
+// cells, and the layer takes an eighth of the room a bool grid would.
+// gridBit and setGridBit work on any such grid, e.g. a chunk's (see
+// OVERWORLD).
+#define ROW_WORDS ((MAP_WIDTH + 63) / 64)
+
+typedef struct
+{
+    uint64_t rows[MAP_HEIGHT][ROW_WORDS];
+} CellSet;
+
+bool gridBit(const uint64_t *words, int rowWords, int x, int y)
+{
+    return words[y * rowWords + x / 64] >> (x % 64) & 1;
+}
+
+void setGridBit(uint64_t *words, int rowWords, int x, int y, bool on)
+{
+    uint64_t bit = UINT64_C(1) << (x % 64);
+    if (on)
+        words[y * rowWords + x / 64] |= bit;
+    else
+        words[y * rowWords + x / 64] &= ~bit;
+}
+
+bool hasCell(const CellSet *set, int x, int y)
+{
+    return set->rows[y][x / 64] >> (x % 64) & 1;
+}
+
+void addCell(CellSet *set, int x, int y)
+{
+    set->rows[y][x / 64] |= UINT64_C(1) << (x % 64);
+}
+
+void clearCells(CellSet *set)
+{
+    memset(set, 0, sizeof(*set));
+}
+
+// The bits of word w that are cells of a row (the last word is not full)
+uint64_t rowWordMask(int w)
+{
+    int used = MAP_WIDTH - w * 64;
+    return used >= 64 ? ~UINT64_C(0) : (UINT64_C(1) << used) - 1;
+}
+
+// The first cell of the set at or after cell (row * MAP_WIDTH + col), or -1
+int nextCell(const CellSet *set, int cell)
+{
+    int x = cell % MAP_WIDTH;
+    for (int y = cell / MAP_WIDTH; y < MAP_HEIGHT; y++, x = 0)
+    {
+        for (int w = x / 64; w < ROW_WORDS; w++)
+        {
+            uint64_t bits = set->rows[y][w];
+            if (w == x / 64)
+                bits &= ~UINT64_C(0) << (x % 64);
+            if (bits)
+                return y * MAP_WIDTH + w * 64 + __builtin_ctzll(bits);
+        }
+    }
+    return -1;
+}
+
+// Cells the player has seen, and those whose drawn look changed since the
+// last frame (see printDungeon)
+_Thread_local CellSet explored;
+_Thread_local bool cellDirty[MAP_HEIGHT][MAP_WIDTH];
+_Thread_local int dirtyCells[MAP_HEIGHT * MAP_WIDTH]; // row * MAP_WIDTH + col
+_Thread_local int dirtyCount = 0;
+// Bit y, laid out like one row of a CellSet: row y of explored grew since
+// updateFrontier
+#define STALE_ROW_WORDS ((MAP_HEIGHT + 63) / 64)
+_Thread_local uint64_t frontierStaleRows[STALE_ROW_WORDS];
+
+// Where one can walk and where the stairs are, built with the rest of a
+// level's indexes
+_Thread_local CellSet walkableCells;
+_Thread_local int stairsDownCell = -1, stairsUpCell = -1; // row * MAP_WIDTH + col, -1 if none
+
+void buildCellIndexes(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    clearCells(&walkableCells);
+    stairsDownCell = stairsUpCell = -1;
+    for (int row = 0; row < MAP_HEIGHT; row++)
+    {
+        for (int col = 0; col < MAP_WIDTH; col++)
+        {
+            if (TILE_HAS(map[row][col], TF_WALKABLE))
+                addCell(&walkableCells, col, row);
+            if (map[row][col] == TILE_STAIRS_DOWN)
+                stairsDownCell = row * MAP_WIDTH + col;
+            else if (map[row][col] == TILE_STAIRS_UP)
+                stairsUpCell = row * MAP_WIDTH + col;
+        }
+    }
+}
+
+void markCellDirty(int x, int y)
+{
+    if (cellDirty[y][x])
+        return;
+    cellDirty[y][x] = true;
+    dirtyCells[dirtyCount++] = y * MAP_WIDTH + x;
+}
+
+//----------------------------------------------------------------------------
+// ITEMS
+//----------------------------------------------------------------------------
+// Items live in a pool apart from the terrain. Each cell keeps the index of
+// the top item of its stack and every item links to the one below it, so
+// pickup, drop and look touch only that cell and never overwrite a tile.
+#define MAX_ITEMS 256
+
+typedef enum
+{
+    ITEM_GOLD,
+    ITEM_BLACK_GOLD,
+    ITEM_FOOD,   // subtype = FoodType
+    ITEM_WEAPON  // subtype = WeaponType
+} ItemKind;
+
+typedef struct
+{
+    ItemKind kind;
+    int subtype;
+    int quantity;
+    int next; // item below this one on the same cell, or -1
+} Item;
+
+_Thread_local Item itemPool[MAX_ITEMS];
+_Thread_local int freeItemHead = -1;               // list of unused pool slots
+_Thread_local int itemAt[MAP_HEIGHT][MAP_WIDTH];   // top item of each cell, or -1
+
+void initItems()
+{
+    for (int i = 0; i < MAX_ITEMS; i++)
+        itemPool[i].next = i + 1 < MAX_ITEMS ? i + 1 : -1;
+    freeItemHead = 0;
+    for (int row = 0; row < MAP_HEIGHT; row++)
+        for (int col = 0; col < MAP_WIDTH; col++)
+            itemAt[row][col] = -1;
+}
+
+void freeItem(int id)
+{
+    itemPool[id].next = freeItemHead;
+    freeItemHead = id;
+}
+
+// Put an item on a cell. Same kind and subtype merge into one stack entry.
+bool dropItem(int x, int y, ItemKind kind, int subtype, int quantity)
+{
+    for (int id = itemAt[y][x]; id != -1; id = itemPool[id].next)
+    {
+        if (itemPool[id].kind == kind && itemPool[id].subtype == subtype)
+        {
+            itemPool[id].quantity += quantity;
+            return true;
+        }
+    }
+    if (freeItemHead == -1)
+        return false;
+
+    int id = freeItemHead;
+    freeItemHead = itemPool[id].next;
+    itemPool[id] = (Item){kind, subtype, quantity, itemAt[y][x]};
+    itemAt[y][x] = id;
+    markCellDirty(x, y);
+    return true;
+}
+
+char itemGlyph(Item *item)
+{
+    switch (item->kind)
+    {
+    case ITEM_GOLD:
+        return GOLD_ICON;
+    case ITEM_BLACK_GOLD:
+        return BLACK_GOLD_ICON;
+    case ITEM_FOOD:
+        return FOOD_ICON;
+    case ITEM_WEAPON:
+        return allWeaponTypes[item->subtype].icon;
+    }
+    return '?';
+}
+
+static const attr_t itemAttr[] = {
+    [ITEM_GOLD] = COLOR_PAIR(PAIR_GOLD) | A_BOLD,
+    [ITEM_BLACK_GOLD] = COLOR_PAIR(PAIR_BLACK_GOLD) | A_BOLD,
+    [ITEM_FOOD] = COLOR_PAIR(PAIR_FOOD),
+    [ITEM_WEAPON] = A_BOLD,
+};
+
+chtype itemCell(Item *item)
+{
+    return (chtype)(unsigned char)itemGlyph(item) | itemAttr[item->kind];
+}
 
 //----------------------------------------------------------------------------
 // ROOM STRUCTURE
@@ -114,6 +420,7 @@ typedef struct
     int centerX, centerY;
     bool created;
     bool visited;
+    long lastSimulatedTurn; // akharin nobati ke in otagh shabih sazi shode
 } Room;
 
 typedef struct
@@ -124,6 +431,8 @@ typedef struct
     int hunger; // az 0 (por) ta 100 (goshne)
 } Player;
 
+void consumeFood(Player *player, int foodIndex);
+
 typedef enum
 {
     ENEMY_DEMON,
@@ -133,24 +442,258 @@ typedef enum
     ENEMY_UNDEAD
 } EnemyType;
 
+#define ENEMY_TYPE_COUNT 5
+
+static const char *enemyTypeNames[ENEMY_TYPE_COUNT] = {"Demon", "Fire monster", "Giant", "Snake", "Undead"};
+
+static const chtype enemyCell[] = {
+    [ENEMY_DEMON] = 'D' | COLOR_PAIR(PAIR_ENEMY),
+    [ENEMY_FIRE] = 'F' | COLOR_PAIR(PAIR_ENEMY) | A_BOLD,
+    [ENEMY_GIANT] = 'G' | COLOR_PAIR(PAIR_ENEMY),
+    [ENEMY_SNAKE] = 'S' | COLOR_PAIR(PAIR_ENEMY),
+    [ENEMY_UNDEAD] = 'U' | COLOR_PAIR(PAIR_ENEMY),
+};
+
+#define PLAYER_CELL ('@' | A_BOLD)
+
 typedef struct
 {
     int x, y;            // Enemy position on the map
     EnemyType type;      // Type of enemy
     int damageThreshold; // Damage needed to kill the enemy
+    int maxDamageThreshold; // Threshold it regenerates back to
     int chasingSteps;    // Steps remaining to chase the player (if applicable)
-    int isActive;        // Active in current room
+    int isActive;        // Awake: has seen the player and takes turns
+    int actionDelay;     // Turns between two actions (bigger = slower)
+    long stunnedUntil;   // Turn until which the enemy cannot act
+    bool scheduled;      // Already has a pending action in the turn queue
 } Enemy;
 
 #define MAX_ENEMIES 20 // Reduced the maximum number of enemies
-Enemy enemies[MAX_ENEMIES];
-int enemyCount = 0;
+_Thread_local Enemy enemies[MAX_ENEMIES];
+_Thread_local int enemyCount = 0;
+
+//----------------------------------------------------------------------------
+// PROJECTILES
+//----------------------------------------------------------------------------
+#define MAX_PROJECTILES 8
+#define PROJECTILE_FRAME_MS 30 // yek khane dar har frame
+
+typedef struct
+{
+    bool active;
+    WeaponType weapon;
+    int x, y;               // Current cell
+    int dx, dy, sx, sy, err; // Bresenham state
+    int travelled;
+    int maxDistance;
+} Projectile;
+
+_Thread_local Projectile projectiles[MAX_PROJECTILES];
+
+// Occupancy grid: index of the living enemy standing on each cell, or -1
+_Thread_local int enemyAt[MAP_HEIGHT][MAP_WIDTH];
+
+void clearEnemyOccupancy()
+{
+    for (int row = 0; row < MAP_HEIGHT; row++)
+        for (int col = 0; col < MAP_WIDTH; col++)
+            enemyAt[row][col] = -1;
+}
+
+void moveEnemyTo(int eIndex, int x, int y)
+{
+    Enemy *enemy = &enemies[eIndex];
+    if (enemyAt[enemy->y][enemy->x] == eIndex)
+        enemyAt[enemy->y][enemy->x] = -1;
+    enemy->x = x;
+    enemy->y = y;
+    enemyAt[y][x] = eIndex;
+}
+
+void removeEnemyFromMap(int eIndex)
+{
+    Enemy *enemy = &enemies[eIndex];
+    if (enemyAt[enemy->y][enemy->x] == eIndex)
+        enemyAt[enemy->y][enemy->x] = -1;
+}
 
 //----------------------------------------------------------------------------
 // GLOBALS
 //----------------------------------------------------------------------------
-int playerX; // col
-int playerY; // row
+_Thread_local int playerX; // col
+_Thread_local int playerY; // row
+_Thread_local int playerRoomIndex = -1; // otaghi ke bazikon alan dar an ast (-1 = rahro)
+_Thread_local int playerDamageBonus = 0; // bonus zarbe az ghazaye momtaz/jadooyi
+
+// Payami ke zir naghshe neshan dade mishavad (bedoone napms)
+_Thread_local char messageLine[MAP_WIDTH + 1] = "";
+
+void setMessage(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vsnprintf(messageLine, sizeof(messageLine), format, args);
+    va_end(args);
+}
+
+bool headless = false; // --headless: no terminal, frames go to stdout
+bool drawFrames = true; // false while a bot plays: the game runs, nothing is drawn
+bool realTime = false;  // --realtime: the world runs on a clock, nothing may block
+_Thread_local long tickBudgetUs = 0; // real-time mode only: length of a tick
+_Thread_local long tickLastUs = -1;  // and how much of it the last simulation step used
+
+long nowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+long nowUs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000L;
+}
+
+// The next floor is built on a worker thread while the player is still on
+// this one (see FLOORS), and simulated games each run on a thread of their
+// own (see SIMULATION). Everything a game changes is _Thread_local, the
+// random numbers included: the floor worker builds into its own copies and
+// never moves the sequence the game itself is playing from. Only the
+// settings from the command line are shared, and nothing writes them once
+// a game is under way.
+_Thread_local unsigned long long randomState = 1;
+
+void seedRandom(unsigned seed)
+{
+    randomState = seed * 0x9E3779B97F4A7C15ULL + 1;
+    if (randomState == 0)
+        randomState = 1;
+}
+
+// xorshift64*, 0..2^31-1 like rand()
+int randomInt()
+{
+    randomState ^= randomState >> 12;
+    randomState ^= randomState << 25;
+    randomState ^= randomState >> 27;
+    return (int)((randomState * 0x2545F4914F6CDD1DULL) >> 33);
+}
+
+//----------------------------------------------------------------------------
+// TURN SCHEDULER
+//----------------------------------------------------------------------------
+// Every actor and timed effect lives in a binary min-heap keyed by the turn on
+// which it should fire. A turn only pops the events that are due, so sleeping
+// enemies (not in the heap) cost nothing until the player moves into their
+// sight (see noticePlayer). Each enemy has at most one event in the heap and
+// the hunger tick always has one; the last slot is kept for the tick, so
+// food effects that fill the rest can never stop the hunger clock.
+#define MAX_EVENTS (MAX_ENEMIES + 8)
+#define HUNGER_TICK_INTERVAL 10 // har chand nobat goshnegi yek vahed ziad mishavad
+#define HUNGER_STARVING 100
+#define STUN_DURATION 3
+#define FOOD_EFFECT_DURATION 20
+#define ENEMY_REGEN_INTERVAL 5  // dar otagh haye door az bazikon
+#define ENEMY_RESPAWN_TURNS 200
+
+typedef enum
+{
+    EV_ENEMY_ACT,      // target = enemy index
+    EV_HUNGER_TICK,    // target unused
+    EV_FOOD_EFFECT_END // target = damage bonus to remove
+} EventType;
+
+typedef struct
+{
+    long time;     // turn on which the event fires
+    long seq;      // insertion order, keeps same-turn events FIFO
+    EventType type;
+    int target;
+} ScheduledEvent;
+
+_Thread_local ScheduledEvent eventQueue[MAX_EVENTS];
+_Thread_local int eventQueueSize = 0;
+_Thread_local long eventSeq = 0;
+_Thread_local long currentTurn = 0;
+
+bool eventBefore(ScheduledEvent *a, ScheduledEvent *b)
+{
+    if (a->time != b->time)
+        return a->time < b->time;
+    return a->seq < b->seq;
+}
+
+void swapEvents(int i, int j)
+{
+    ScheduledEvent tmp = eventQueue[i];
+    eventQueue[i] = eventQueue[j];
+    eventQueue[j] = tmp;
+}
+
+bool scheduleEvent(long time, EventType type, int target)
+{
+    if (eventQueueSize >= (type == EV_HUNGER_TICK ? MAX_EVENTS : MAX_EVENTS - 1))
+        return false;
+
+    int i = eventQueueSize++;
+    eventQueue[i] = (ScheduledEvent){time, eventSeq++, type, target};
+
+    // Sift up
+    while (i > 0)
+    {
+        int parent = (i - 1) / 2;
+        if (!eventBefore(&eventQueue[i], &eventQueue[parent]))
+            break;
+        swapEvents(i, parent);
+        i = parent;
+    }
+    return true;
+}
+
+void siftDownEvent(int i)
+{
+    while (true)
+    {
+        int left = 2 * i + 1;
+        int right = left + 1;
+        int smallest = i;
+        if (left < eventQueueSize && eventBefore(&eventQueue[left], &eventQueue[smallest]))
+            smallest = left;
+        if (right < eventQueueSize && eventBefore(&eventQueue[right], &eventQueue[smallest]))
+            smallest = right;
+        if (smallest == i)
+            break;
+        swapEvents(i, smallest);
+        i = smallest;
+    }
+}
+
+bool popDueEvent(long now, ScheduledEvent *out)
+{
+    if (eventQueueSize == 0 || eventQueue[0].time > now)
+        return false;
+
+    *out = eventQueue[0];
+    eventQueue[0] = eventQueue[--eventQueueSize];
+    siftDownEvent(0);
+    return true;
+}
+
+// Forget every event of one type, e.g. the monster turns of a floor the
+// player leaves, and heap up what is left
+void dropEvents(EventType type)
+{
+    int kept = 0;
+    for (int i = 0; i < eventQueueSize; i++)
+        if (eventQueue[i].type != type)
+            eventQueue[kept++] = eventQueue[i];
+    eventQueueSize = kept;
+    for (int i = kept / 2 - 1; i >= 0; i--)
+        siftDownEvent(i);
+}
 
 //----------------------------------------------------------------------------
 // HELPER FUNCTIONS
@@ -165,83 +708,45 @@ bool is_overlap(Room *a, Room *b)
     return true;
 }
 
-void init_map(char map[MAP_HEIGHT][MAP_WIDTH])
+void init_map(Tile map[MAP_HEIGHT][MAP_WIDTH])
 {
     // Fill entire map with space
     for (int row = 0; row < MAP_HEIGHT; row++)
     {
         for (int col = 0; col < MAP_WIDTH; col++)
         {
-            map[row][col] = ' ';
-        }
-    }
-}
-void showFoodMenu(Player *player)
-{
-    // namayesh navare goshnegi
-    printw("sathe goshnegi: [");
-    for (int i = 0; i < 10; i++)
-    {
-        if ((player->hunger / 10) > i)
-            printw("#");
-        else
-            printw("-");
-    }
-    printw("]\n");
-
-    // namayesh liste ghazahaye mojood
-    printw("mojoodi ghaza:\n");
-    for (int i = 0; i < foodCount; i++)
-    {
-        printw("%d: ", i + 1);
-        switch (foodInventory[i].type)
-        {
-        case COMMON_FOOD:
-            printw("ghazaye mamooli (bazgardani salamat: %d)\n", foodInventory[i].healthRestore);
-            break;
-        case SUPERIOR_FOOD:
-            printw("ghazaye momtaz (bazgardani salamat: %d)\n", foodInventory[i].healthRestore);
-            break;
-        case MAGIC_FOOD:
-            printw("ghazaye jadooyi (bazgardani salamat: %d)\n", foodInventory[i].healthRestore);
-            break;
-        case CORRUPTED_FOOD:
-            printw("ghazaye fased shode (bazgardani salamat: %d, ehtiat!)\n", foodInventory[i].healthRestore);
-            break;
+            map[row][col] = TILE_ROCK;
         }
     }
-    printw("baraye masraf ghaza, shomare marboote ra vared konid, ya har kelide digar baraye khorooj.\n");
-
-    // daryaft voroodi karbar (masalan ba getch) va pardazesh entekhab
-    int choice = getch() - '1';
-    if (choice >= 0 && choice < foodCount)
-    {
-        consumeFood(player, choice);
-    }
 }
-
-void display_map(char map[MAP_HEIGHT][MAP_WIDTH])
+void display_map(Tile map[MAP_HEIGHT][MAP_WIDTH])
 {
+    if (headless)
+        return; // stdscr only exists with a terminal
     // Clear screen and display map
     clear();
+    chtype line[MAP_WIDTH];
     for (int row = 0; row < MAP_HEIGHT; row++)
     {
         for (int col = 0; col < MAP_WIDTH; col++)
         {
-            mvaddch(row, col, map[row][col]);
+            if (itemAt[row][col] != -1)
+                line[col] = itemCell(&itemPool[itemAt[row][col]]);
+            else
+                line[col] = tileCell[map[row][col]];
         }
+        mvaddchnstr(row, 0, line, MAP_WIDTH);
     }
     refresh();
 }
 
-bool isWalkable(char map[MAP_HEIGHT][MAP_WIDTH], int x, int y)
+bool isWalkable(Tile map[MAP_HEIGHT][MAP_WIDTH], int x, int y)
 {
     // Check if a tile is walkable (floor, corridor, door, etc.)
     if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT)
         return false;
 
-    char tile = map[y][x];
-    return (tile == FLOOR || tile == CORRIDOR || tile == DOOR || tile == PILLAR || tile == GOLD_ICON || tile == BLACK_GOLD_ICON);
+    return TILE_HAS(map[y][x], TF_WALKABLE);
 }
 
 int roomIndexAt(int room_count, Room rooms[], int x, int y)
@@ -263,33 +768,43 @@ int roomIndexAt(int room_count, Room rooms[], int x, int y)
 //----------------------------------------------------------------------------
 // MAP CREATION
 //----------------------------------------------------------------------------
-void draw_room(char map[MAP_HEIGHT][MAP_WIDTH], Room room)
+// Rooms and corridors are drawn on any grid of tiles, cell (x, y) being
+// cells[y * stride + x]: the level map, or one chunk of the overworld
+// (see OVERWORLD).
+void drawRoomOn(Tile *cells, int stride, Room room)
 {
     // Fill in the floor area
     for (int row = room.y + 1; row < room.y + room.height - 1; row++)
     {
         for (int col = room.x + 1; col < room.x + room.width - 1; col++)
         {
-            map[row][col] = FLOOR;
+            cells[row * stride + col] = TILE_FLOOR;
         }
     }
 
     // Walls (horizontal)
     for (int col = room.x; col < room.x + room.width; col++)
     {
-        map[room.y][col] = WALL_HORIZONTAL;
-        map[room.y + room.height - 1][col] = WALL_HORIZONTAL;
+        cells[room.y * stride + col] = TILE_WALL_HORIZONTAL;
+        cells[(room.y + room.height - 1) * stride + col] = TILE_WALL_HORIZONTAL;
     }
 
     // Walls (vertical)
     for (int row = room.y; row < room.y + room.height; row++)
     {
-        map[row][room.x] = WALL_VERTICAL;
-        map[row][room.x + room.width - 1] = WALL_VERTICAL;
+        cells[row * stride + room.x] = TILE_WALL_VERTICAL;
+        cells[row * stride + room.x + room.width - 1] = TILE_WALL_VERTICAL;
     }
 }
 
-void draw_corridor(char map[MAP_HEIGHT][MAP_WIDTH], int x1, int y1, int x2, int y2)
+void draw_room(Tile map[MAP_HEIGHT][MAP_WIDTH], Room room)
+{
+    drawRoomOn(&map[0][0], MAP_WIDTH, room);
+}
+
+// Horizontal leg along y1, then vertical along x2; either leg makes a door
+// where it crosses a wall
+void drawCorridorOn(Tile *cells, int stride, int x1, int y1, int x2, int y2)
 {
     // Draw corridor horizontally
     int startX = (x1 < x2) ? x1 : x2;
@@ -297,10 +812,11 @@ void draw_corridor(char map[MAP_HEIGHT][MAP_WIDTH], int x1, int y1, int x2, int
 
     for (int col = startX; col <= endX; col++)
     {
-        if (map[y1][col] == ' ' || map[y1][col] == DOOR)
-            map[y1][col] = CORRIDOR;
-        if (map[y1][col] == '|' || map[y1][col] == '-')
-            map[y1][col] = DOOR;
+        Tile *cell = &cells[y1 * stride + col];
+        if (*cell == TILE_ROCK || TILE_HAS(*cell, TF_DOOR))
+            *cell = TILE_CORRIDOR;
+        if (TILE_HAS(*cell, TF_WALL))
+            *cell = TILE_DOOR;
     }
 
     // Draw corridor vertically
@@ -308,12 +824,21 @@ void draw_corridor(char map[MAP_HEIGHT][MAP_WIDTH], int x1, int y1, int x2, int
     int endY = (y1 < y2) ? y2 : y1;
     for (int row = startY; row <= endY; row++)
     {
-        if (map[row][x2] == ' ' || map[row][x2] == DOOR)
-            map[row][x2] = CORRIDOR;
+        Tile *cell = &cells[row * stride + x2];
+        if (*cell == TILE_ROCK || TILE_HAS(*cell, TF_DOOR))
+            *cell = TILE_CORRIDOR;
+        if (TILE_HAS(*cell, TF_WALL))
+            *cell = TILE_DOOR;
     }
 }
 
-int generate_rooms(Room rooms[], int max_rooms, char map[MAP_HEIGHT][MAP_WIDTH])
+void draw_corridor(Tile map[MAP_HEIGHT][MAP_WIDTH], int x1, int y1, int x2, int y2)
+{
+    drawCorridorOn(&map[0][0], MAP_WIDTH, x1, y1, x2, y2);
+}
+
+// Up to max_rooms rooms that do not overlap, inside the given area
+int placeRooms(Room rooms[], int max_rooms, int left, int top, int areaWidth, int areaHeight)
 {
     int room_count = 0;
     int attempts = 0;
@@ -321,13 +846,13 @@ int generate_rooms(Room rooms[], int max_rooms, char map[MAP_HEIGHT][MAP_WIDTH])
     while (room_count < max_rooms && attempts < 200)
     {
         attempts++;
-        int width = 4 + rand() % 7;  // possible range: 4..10
-        int height = 4 + rand() % 5; // possible range: 4..8
+        int width = 4 + randomInt() % 7;  // possible range: 4..10
+        int height = 4 + randomInt() % 5; // possible range: 4..8
 
-        int x = 1 + rand() % (MAP_WIDTH - width - 1);
-        int y = 1 + rand() % (MAP_HEIGHT - height - 1);
+        int x = left + 1 + randomInt() % (areaWidth - width - 1);
+        int y = top + 1 + randomInt() % (areaHeight - height - 1);
 
-        Room new_room = {x, y, width, height, 0, 0, true, false};
+        Room new_room = {x, y, width, height, 0, 0, true, false, 0};
         new_room.centerX = x + width / 2;
         new_room.centerY = y + height / 2;
 
@@ -349,884 +874,5338 @@ int generate_rooms(Room rooms[], int max_rooms, char map[MAP_HEIGHT][MAP_WIDTH])
     return room_count;
 }
 
+int generate_rooms(Room rooms[], int max_rooms)
+{
+    return placeRooms(rooms, max_rooms, 0, 0, MAP_WIDTH, MAP_HEIGHT);
+}
+
 //----------------------------------------------------------------------------
-// VISIBILITY
+// ROOM GRAPH
 //----------------------------------------------------------------------------
-void updateVisibility(Room rooms[], int room_count,
-                      char dungeon[MAP_HEIGHT][MAP_WIDTH],
-                      bool visible[MAP_HEIGHT][MAP_WIDTH])
+// Which rooms a corridor joins, and through which doors. The generator
+// records the links as it digs them, so anything that needs to know how
+// rooms connect asks here instead of reading tiles: 'g' 'r' plans its way to
+// a new room over it (see nearestUnvisitedRoom), and the overworld rebuilds
+// it for every window it composes.
+#define MAX_ROOM_LINKS (MAX_ROOMS * 2)
+
+typedef struct
 {
-    // Reset all cells to invisible
-    for (int row = 0; row < MAP_HEIGHT; row++)
-    {
-        for (int col = 0; col < MAP_WIDTH; col++)
-        {
-            visible[row][col] = false;
-        }
-    }
+    int a, b;         // room indexes
+    int doorA, doorB; // door cells (row * MAP_WIDTH + col), -1 when not known
+    int length;       // corridor cells between the doors
+} RoomLink;
+
+_Thread_local RoomLink roomLinks[MAX_ROOM_LINKS];
+_Thread_local int roomLinkCount = 0;
+_Thread_local int roomNeighbours[MAX_ROOMS][MAX_ROOMS]; // indexes into roomLinks
+_Thread_local int roomNeighbourCount[MAX_ROOMS];
+
+void clearRoomGraph()
+{
+    roomLinkCount = 0;
+    for (int i = 0; i < MAX_ROOMS; i++)
+        roomNeighbourCount[i] = 0;
+}
+
+void addRoomLink(int a, int b, int doorA, int doorB, int length)
+{
+    if (roomLinkCount >= MAX_ROOM_LINKS)
+        return;
+    roomLinks[roomLinkCount] = (RoomLink){a, b, doorA, doorB, length};
+    roomNeighbours[a][roomNeighbourCount[a]++] = roomLinkCount;
+    roomNeighbours[b][roomNeighbourCount[b]++] = roomLinkCount;
+    roomLinkCount++;
+}
 
-    // Reveal all visited rooms
-    for (int r = 0; r < room_count; r++)
+// The link between two rooms, or -1
+int roomLinkBetween(int a, int b)
+{
+    for (int i = 0; i < roomNeighbourCount[a]; i++)
     {
-        if (rooms[r].visited)
-        {
-            for (int row = rooms[r].y; row < rooms[r].y + rooms[r].height; row++)
-            {
-                for (int col = rooms[r].x; col < rooms[r].x + rooms[r].width; col++)
-                {
-                    visible[row][col] = true;
-                }
-            }
-        }
+        RoomLink *link = &roomLinks[roomNeighbours[a][i]];
+        if ((link->a == a && link->b == b) || (link->a == b && link->b == a))
+            return roomNeighbours[a][i];
     }
+    return -1;
+}
+
+// The room at the other end of a link
+int linkedRoom(int link, int from)
+{
+    return roomLinks[link].a == from ? roomLinks[link].b : roomLinks[link].a;
+}
+
+//----------------------------------------------------------------------------
+// DOOR GRAPH
+//----------------------------------------------------------------------------
+// Built once per level from the finished map: every door is a node, and an
+// edge joins two doors that are connected by corridor alone or that belong
+// to the same room, with the walking distance between them. Long trips are
+// planned over this graph (a few hundred nodes at most) and only the short
+// legs between consecutive doors are searched tile by tile.
+#define MAX_DOORS 256
+#define MAX_DOOR_EDGES 4096
+
+typedef struct
+{
+    int cell;  // row * MAP_WIDTH + col
+    int room;  // room whose wall the door is in, or -1
+    int firstEdge, edgeCount;
+} DoorNode;
+
+typedef struct
+{
+    int to;     // door index
+    int length; // steps
+} DoorEdge;
+
+_Thread_local DoorNode doors[MAX_DOORS];
+_Thread_local int doorCount = 0;
+_Thread_local DoorEdge doorEdges[MAX_DOOR_EDGES];
+_Thread_local int doorEdgeCount = 0;
+_Thread_local int doorIndexAt[MAP_HEIGHT][MAP_WIDTH]; // -1 where there is no door
+_Thread_local int cellRoom[MAP_HEIGHT][MAP_WIDTH];    // room (walls included) or -1 for corridors and rock
+
+bool isCorridorCell(Tile map[MAP_HEIGHT][MAP_WIDTH], int x, int y)
+{
+    return isWalkable(map, x, y) && cellRoom[y][x] == -1;
+}
+
+// Distances from (x, y) through corridor cells to the doors they lead to.
+// Calls found(door, length) for each door reached.
+void corridorDoors(Tile map[MAP_HEIGHT][MAP_WIDTH], int x0, int y0, int skipDoor,
+                   void (*found)(int door, int length, void *context), void *context)
+{
+    static const int dx[4] = {0, 0, -1, 1}, dy[4] = {-1, 1, 0, 0};
+    static _Thread_local int distance[MAP_HEIGHT * MAP_WIDTH];
+    static _Thread_local int queue[MAP_HEIGHT * MAP_WIDTH];
+    static _Thread_local int seen[MAP_HEIGHT * MAP_WIDTH];
+    static _Thread_local int stamp = 0;
+    stamp++;
+
+    int head = 0, tail = 0;
+    queue[tail++] = y0 * MAP_WIDTH + x0;
+    seen[y0 * MAP_WIDTH + x0] = stamp;
+    distance[y0 * MAP_WIDTH + x0] = 0;
+    while (head < tail)
+    {
+        int cell = queue[head++];
+        int x = cell % MAP_WIDTH, y = cell / MAP_WIDTH;
+        int door = doorIndexAt[y][x];
+        if (door != -1 && door != skipDoor)
+        {
+            found(door, distance[cell], context);
+            continue; // the way on goes through the room behind it
+        }
+        for (int d = 0; d < 4; d++)
+        {
+            int nx = x + dx[d], ny = y + dy[d];
+            if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT || seen[ny * MAP_WIDTH + nx] == stamp)
+                continue;
+            if (!isCorridorCell(map, nx, ny) && doorIndexAt[ny][nx] == -1)
+                continue;
+            seen[ny * MAP_WIDTH + nx] = stamp;
+            distance[ny * MAP_WIDTH + nx] = distance[cell] + 1;
+            queue[tail++] = ny * MAP_WIDTH + nx;
+        }
+    }
+}
+
+void addDoorEdge(int door, int length, void *context)
+{
+    if (doorEdgeCount >= MAX_DOOR_EDGES)
+        return;
+    doorEdges[doorEdgeCount++] = (DoorEdge){door, length};
+    ((DoorNode *)context)->edgeCount++;
+}
+
+// Steps between two doors of the same room: across the open floor, plus
+// one step in and one out when both are in the same wall
+int doorToDoorInRoom(DoorNode *a, DoorNode *b)
+{
+    int ax = a->cell % MAP_WIDTH, ay = a->cell / MAP_WIDTH;
+    int bx = b->cell % MAP_WIDTH, by = b->cell / MAP_WIDTH;
+    return abs(ax - bx) + abs(ay - by) + (ax == bx || ay == by ? 2 : 0);
+}
 
-    // Reveal corridors that border any already-visible cell
+void buildDoorGraph(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[], int room_count)
+{
+    doorCount = 0;
+    doorEdgeCount = 0;
     for (int row = 0; row < MAP_HEIGHT; row++)
     {
         for (int col = 0; col < MAP_WIDTH; col++)
         {
-            if (dungeon[row][col] == CORRIDOR)
+            cellRoom[row][col] = roomIndexAt(room_count, rooms, col, row);
+            doorIndexAt[row][col] = -1;
+            if (TILE_HAS(map[row][col], TF_DOOR) && doorCount < MAX_DOORS)
             {
-                // If any neighbor is visible, reveal this corridor cell too
-                for (int dy = -1; dy <= 1; dy++)
-                {
-                    for (int dx = -1; dx <= 1; dx++)
-                    {
-                        int ny = row + dy;
-                        int nx = col + dx;
-                        if (ny >= 0 && ny < MAP_HEIGHT &&
-                            nx >= 0 && nx < MAP_WIDTH)
-                        {
-                            if (visible[ny][nx])
-                            {
-                                visible[row][col] = true;
-                                goto nextCell;
-                            }
-                        }
-                    }
-                }
+                doors[doorCount] = (DoorNode){row * MAP_WIDTH + col, cellRoom[row][col], 0, 0};
+                doorIndexAt[row][col] = doorCount++;
             }
-        nextCell:;
         }
     }
 
-    // Reveal cells around the player's current position in a 3x3 block
-    for (int dy = -1; dy <= 1; dy++)
+    for (int i = 0; i < doorCount; i++)
     {
-        for (int dx = -1; dx <= 1; dx++)
+        DoorNode *door = &doors[i];
+        door->firstEdge = doorEdgeCount;
+        corridorDoors(map, door->cell % MAP_WIDTH, door->cell / MAP_WIDTH, i, addDoorEdge, door);
+        for (int j = 0; j < doorCount; j++)
         {
-            int adjX = playerX + dx;
-            int adjY = playerY + dy;
-            if (adjX >= 0 && adjX < MAP_WIDTH && adjY >= 0 && adjY < MAP_HEIGHT)
+            if (j != i && door->room != -1 && doors[j].room == door->room && doorEdgeCount < MAX_DOOR_EDGES)
             {
-                visible[adjY][adjX] = true;
+                doorEdges[doorEdgeCount++] = (DoorEdge){j, doorToDoorInRoom(door, &doors[j])};
+                door->edgeCount++;
             }
         }
     }
 }
 
-void printDungeon(char map[MAP_HEIGHT][MAP_WIDTH],
-                  bool visible[MAP_HEIGHT][MAP_WIDTH],
-                  Room rooms[], int room_count)
+typedef struct
 {
-    // Clear screen and update visibility before printing
-    clear();
-    updateVisibility(rooms, room_count, map, visible);
+    int cost[MAX_DOORS]; // from the start to each door, -1 if not reachable
+} DoorCosts;
 
-    // Draw only the tiles that are marked visible
-    for (int row = 0; row < MAP_HEIGHT; row++)
+void setDoorCost(int door, int length, void *context)
+{
+    int *cost = ((DoorCosts *)context)->cost;
+    if (cost[door] == -1 || length < cost[door])
+        cost[door] = length;
+}
+
+// Cost from a cell to the doors it can walk to directly: the doors of its
+// room, or the doors at the ends of its corridor
+void doorsAround(Tile map[MAP_HEIGHT][MAP_WIDTH], int x, int y, DoorCosts *costs)
+{
+    for (int i = 0; i < doorCount; i++)
+        costs->cost[i] = -1;
+    int room = cellRoom[y][x];
+    if (doorIndexAt[y][x] != -1)
+        costs->cost[doorIndexAt[y][x]] = 0;
+    if (room != -1)
     {
-        move(row, 0);
-        for (int col = 0; col < MAP_WIDTH; col++)
-        {
-            if (visible[row][col])
-                addch(map[row][col]);
-            else
-                addch(' ');
-        }
+        for (int i = 0; i < doorCount; i++)
+            if (doors[i].room == room && costs->cost[i] == -1)
+                costs->cost[i] = abs(doors[i].cell % MAP_WIDTH - x) + abs(doors[i].cell / MAP_WIDTH - y);
     }
+    else
+        corridorDoors(map, x, y, -1, setDoorCost, costs);
+}
 
-    // Print the enemies
-    for (int i = 0; i < enemyCount; i++)
+// Dijkstra over the door graph. usable(door) limits which doors the route
+// may go on from (e.g. only those already seen); an unusable door can still
+// be the end of it. Fills cost and previous door for every reached door;
+// start costs come from doorsAround().
+void doorDistances(DoorCosts *start, bool (*usable)(int door), int cost[MAX_DOORS], int previous[MAX_DOORS])
+{
+    bool done[MAX_DOORS];
+    for (int i = 0; i < doorCount; i++)
+    {
+        done[i] = false;
+        cost[i] = start->cost[i];
+        previous[i] = -1;
+    }
+    while (true)
     {
-        if (enemies[i].isActive && visible[enemies[i].y][enemies[i].x])
+        int best = -1;
+        for (int i = 0; i < doorCount; i++)
+            if (!done[i] && cost[i] != -1 && (best == -1 || cost[i] < cost[best]))
+                best = i;
+        if (best == -1)
+            return;
+        done[best] = true;
+        if (usable && !usable(best))
+            continue;
+        DoorNode *door = &doors[best];
+        for (int e = door->firstEdge; e < door->firstEdge + door->edgeCount; e++)
         {
-            char enemyIcon;
-            switch (enemies[i].type)
+            int next = doorEdges[e].to;
+            if (done[next])
+                continue;
+            int through = cost[best] + doorEdges[e].length;
+            if (cost[next] == -1 || through < cost[next])
             {
-            case ENEMY_DEMON:
-                enemyIcon = 'D';
-                break;
-            case ENEMY_FIRE:
-                enemyIcon = 'F';
-                break;
-            case ENEMY_GIANT:
-                enemyIcon = 'G';
-                break;
-            case ENEMY_SNAKE:
-                enemyIcon = 'S';
-                break;
-            case ENEMY_UNDEAD:
-                enemyIcon = 'U';
-                break;
+                cost[next] = through;
+                previous[next] = best;
             }
-            mvaddch(enemies[i].y, enemies[i].x, enemyIcon);
         }
     }
-
-    // Print the player
-    mvaddch(playerY, playerX, '@');
-    refresh();
 }
 
-// tabe gharar dadan tala rooye naghshe (tala adi)
-void placeRegularGold(char map[MAP_HEIGHT][MAP_WIDTH])
+//----------------------------------------------------------------------------
+// BSP GENERATOR
+//----------------------------------------------------------------------------
+// --generator bsp: the map is split in two again and again (always the
+// biggest piece that can still be split) until there is a piece per room,
+// and a room is placed inside each piece with a border of rock around it.
+// The rooms are then joined along a minimum spanning tree of their centres
+// plus a few of the shortest remaining pairs for loops. Every corridor is
+// dug through rock only, from a door on one room to a door on the other,
+// so it never cuts through a third room.
+#define GEN_CLASSIC 0
+#define GEN_BSP 1
+#define BSP_MIN_WIDTH 8
+#define BSP_MIN_HEIGHT 7
+#define BSP_LOOP_LINKS 2
+#define BSP_DOOR_TRIES 6 // door pairs tried on the facing walls before a link is given up
+
+int levelGenerator = GEN_CLASSIC;
+
+typedef struct
 {
-    int numGoldBags = 20;
-    while (numGoldBags > 0)
+    int x, y, w, h;
+} Region;
+
+int splitRegions(Region regions[], int max_regions)
+{
+    int count = 1;
+    regions[0] = (Region){1, 1, MAP_WIDTH - 2, MAP_HEIGHT - 2};
+    while (count < max_regions)
     {
-        int x = rand() % MAP_WIDTH;
-        int y = rand() % MAP_HEIGHT;
-        // faghat agar makani kaf (FLOOR) dashte bashad
-        if (map[y][x] == FLOOR)
+        // Biggest region that can still be split
+        int pick = -1;
+        for (int i = 0; i < count; i++)
         {
-            map[y][x] = GOLD_ICON;
-            numGoldBags--;
+            bool splittable = regions[i].w >= 2 * BSP_MIN_WIDTH || regions[i].h >= 2 * BSP_MIN_HEIGHT;
+            if (splittable && (pick == -1 || regions[i].w * regions[i].h > regions[pick].w * regions[pick].h))
+                pick = i;
+        }
+        if (pick == -1)
+            break;
+
+        Region *r = &regions[pick];
+        Region other = *r;
+        // Cut across the longer side (in cells, counting the 2:1 look of a terminal cell)
+        bool vertical = r->h < 2 * BSP_MIN_HEIGHT || (r->w >= 2 * BSP_MIN_WIDTH && r->w > 2 * r->h);
+        if (vertical)
+        {
+            int cut = BSP_MIN_WIDTH + randomInt() % (r->w - 2 * BSP_MIN_WIDTH + 1);
+            other.x = r->x + cut;
+            other.w = r->w - cut;
+            r->w = cut;
         }
+        else
+        {
+            int cut = BSP_MIN_HEIGHT + randomInt() % (r->h - 2 * BSP_MIN_HEIGHT + 1);
+            other.y = r->y + cut;
+            other.h = r->h - cut;
+            r->h = cut;
+        }
+        regions[count++] = other;
     }
+    return count;
 }
 
-// tabe gharar dadan talaye siyah rooye naghshe
-void placeBlackGold(char map[MAP_HEIGHT][MAP_WIDTH])
+// A door in the wall of room facing (toX, toY); the cell just outside it in *outside
+int pickDoor(Room *room, int toX, int toY, int *outside)
 {
-    int numBlackGoldBags = 5;
-    while (numBlackGoldBags > 0)
+    int dx = toX - room->centerX, dy = toY - room->centerY;
+    int x, y, ox = 0, oy = 0;
+    if (abs(dx) * 2 >= abs(dy) * 3) // cells are about twice as tall as wide
     {
-        int x = rand() % MAP_WIDTH;
-        int y = rand() % MAP_HEIGHT;
-        // tala rooye kaf otagh gharar girad
-        if (map[y][x] == FLOOR)
+        y = room->y + 1 + randomInt() % (room->height - 2);
+        x = dx > 0 ? room->x + room->width - 1 : room->x;
+        ox = dx > 0 ? 1 : -1;
+    }
+    else
+    {
+        x = room->x + 1 + randomInt() % (room->width - 2);
+        y = dy > 0 ? room->y + room->height - 1 : room->y;
+        oy = dy > 0 ? 1 : -1;
+    }
+    *outside = (y + oy) * MAP_WIDTH + x + ox;
+    return y * MAP_WIDTH + x;
+}
+
+// Dig the shortest way through rock from one cell to another. Returns the
+// corridor length, or -1 when rooms are in the way.
+int digCorridor(Tile map[MAP_HEIGHT][MAP_WIDTH], int from, int to)
+{
+    static const int dx[4] = {0, 0, -1, 1}, dy[4] = {-1, 1, 0, 0};
+    static _Thread_local int cameFrom[MAP_HEIGHT * MAP_WIDTH];
+    static _Thread_local int queue[MAP_HEIGHT * MAP_WIDTH];
+    for (int i = 0; i < MAP_HEIGHT * MAP_WIDTH; i++)
+        cameFrom[i] = -2;
+    int head = 0, tail = 0;
+    queue[tail++] = from;
+    cameFrom[from] = -1;
+    while (head < tail && cameFrom[to] == -2)
+    {
+        int cell = queue[head++];
+        int x = cell % MAP_WIDTH, y = cell / MAP_WIDTH;
+        for (int d = 0; d < 4; d++)
         {
-            map[y][x] = BLACK_GOLD_ICON;
-            numBlackGoldBags--;
+            int nx = x + dx[d], ny = y + dy[d];
+            if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT)
+                continue;
+            int next = ny * MAP_WIDTH + nx;
+            if (cameFrom[next] != -2 || (map[ny][nx] != TILE_ROCK && map[ny][nx] != TILE_CORRIDOR))
+                continue;
+            cameFrom[next] = cell;
+            queue[tail++] = next;
         }
     }
+    if (cameFrom[to] == -2)
+        return -1;
+    int length = 0;
+    for (int cell = to; cell != -1; cell = cameFrom[cell], length++)
+        map[cell / MAP_WIDTH][cell % MAP_WIDTH] = TILE_CORRIDOR;
+    return length;
 }
 
-// tabe etela resani be bazikon hengam bardasht tala
-void show_gold_message(int collected)
+// Join two rooms with a corridor, trying other doors on the facing walls
+// when one comes out against a room or no way through the rock is found.
+// False when none of them could be joined.
+bool linkRooms(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[], int a, int b)
 {
-    attron(A_BOLD);
-    mvprintw(MAP_HEIGHT, 0, "you have collected %d golds", collected);
-    attroff(A_BOLD);
-    refresh();
-    // movaghat ta bazikon motevajeh shavad
-    napms(700);
-    // pak kardan payam
-    move(MAP_HEIGHT, 0);
-    clrtoeol();
-    refresh();
+    for (int try = 0; try < BSP_DOOR_TRIES; try++)
+    {
+        int outA, outB;
+        int doorA = pickDoor(&rooms[a], rooms[b].centerX, rooms[b].centerY, &outA);
+        int doorB = pickDoor(&rooms[b], rooms[a].centerX, rooms[a].centerY, &outB);
+        Tile outATile = map[outA / MAP_WIDTH][outA % MAP_WIDTH], outBTile = map[outB / MAP_WIDTH][outB % MAP_WIDTH];
+        if ((outATile != TILE_ROCK && outATile != TILE_CORRIDOR) || (outBTile != TILE_ROCK && outBTile != TILE_CORRIDOR))
+            continue;
+        int length = digCorridor(map, outA, outB);
+        if (length < 0)
+            continue;
+        map[doorA / MAP_WIDTH][doorA % MAP_WIDTH] = TILE_DOOR;
+        map[doorB / MAP_WIDTH][doorB % MAP_WIDTH] = TILE_DOOR;
+        addRoomLink(a, b, doorA, doorB, length);
+        return true;
+    }
+    return false;
 }
 
-void display_final_score()
+int roomDistance(Room *a, Room *b)
 {
-    clear();
-    attron(A_BOLD);
-    mvprintw(MAP_HEIGHT / 2 - 1, MAP_WIDTH / 2 - 10, "bazi be payan resid!");
-    mvprintw(MAP_HEIGHT / 2, MAP_WIDTH / 2 - 10, "kol tala: %d", playerGold);
-    mvprintw(MAP_HEIGHT / 2 + 1, MAP_WIDTH / 2 - 10, "emtiyaz shoma: %d", playerGold);
-    attroff(A_BOLD);
-    refresh();
-    getch();
+    return abs(a->centerX - b->centerX) + abs(a->centerY - b->centerY);
 }
 
-void placeFood(char map[MAP_HEIGHT][MAP_WIDTH])
+int generateBspLevel(Room rooms[], int max_rooms, Tile map[MAP_HEIGHT][MAP_WIDTH])
 {
-    int numFoodItems = 10;
-    while (numFoodItems > 0)
+    Region regions[MAX_ROOMS];
+    int room_count = splitRegions(regions, max_rooms < MAX_ROOMS ? max_rooms : MAX_ROOMS);
+
+    for (int i = 0; i < room_count; i++)
     {
-        int x = rand() % MAP_WIDTH;
-        int y = rand() % MAP_HEIGHT;
-        // Place food only on floor tiles
-        if (map[y][x] == FLOOR)
+        Region *r = &regions[i];
+        int maxWidth = r->w - 2 < 10 ? r->w - 2 : 10;
+        int maxHeight = r->h - 2 < 8 ? r->h - 2 : 8;
+        int width = 4 + randomInt() % (maxWidth - 3);
+        int height = 4 + randomInt() % (maxHeight - 3);
+        int x = r->x + 1 + randomInt() % (r->w - width - 1);
+        int y = r->y + 1 + randomInt() % (r->h - height - 1);
+        rooms[i] = (Room){x, y, width, height, x + width / 2, y + height / 2, true, false, 0};
+        draw_room(map, rooms[i]);
+    }
+
+    // Prim's minimum spanning tree over the room centres. An edge that
+    // cannot be dug is left out and the next cheapest one is tried instead.
+    bool inTree[MAX_ROOMS] = {true};
+    bool linked[MAX_ROOMS][MAX_ROOMS] = {{false}};
+    for (int added = 1; added < room_count;)
+    {
+        int bestA = -1, bestB = -1;
+        for (int a = 0; a < room_count; a++)
+            for (int b = 0; b < room_count; b++)
+                if (inTree[a] && !inTree[b] && !linked[a][b] &&
+                    (bestA == -1 || roomDistance(&rooms[a], &rooms[b]) < roomDistance(&rooms[bestA], &rooms[bestB])))
+                {
+                    bestA = a;
+                    bestB = b;
+                }
+        if (bestA == -1)
+            break; // the rooms left cannot be reached (see LEVEL CHECK)
+        linked[bestA][bestB] = linked[bestB][bestA] = true;
+        if (linkRooms(map, rooms, bestA, bestB))
         {
-            map[y][x] = FOOD_ICON;
-            numFoodItems--;
+            inTree[bestB] = true;
+            added++;
         }
     }
+
+    // A few loops: the shortest pairs not joined yet
+    for (int loop = 0; loop < BSP_LOOP_LINKS; loop++)
+    {
+        int bestA = -1, bestB = -1;
+        for (int a = 0; a < room_count; a++)
+            for (int b = a + 1; b < room_count; b++)
+                if (!linked[a][b] &&
+                    (bestA == -1 || roomDistance(&rooms[a], &rooms[b]) < roomDistance(&rooms[bestA], &rooms[bestB])))
+                {
+                    bestA = a;
+                    bestB = b;
+                }
+        if (bestA == -1)
+            break;
+        linked[bestA][bestB] = linked[bestB][bestA] = true;
+        linkRooms(map, rooms, bestA, bestB);
+    }
+    return room_count;
 }
 
-void consumeFood(Player *player, int foodIndex)
+//----------------------------------------------------------------------------
+// RENDER BACKEND
+//----------------------------------------------------------------------------
+// All drawing goes through Surfaces. With ncurses a Surface is a window (or
+// a pad) inside a panel; in headless mode it is a plain grid of chtype cells
+// in memory, and the stacked surfaces are composed into frameBuffer. The same
+// printDungeon/displayInventory code then runs with no terminal at all, which
+// is what benchmarks and golden-frame comparisons use.
+#define MAX_SURFACES 8
+#define MAX_FRAME_ROWS (MAP_HEIGHT + 2)
+#define MAX_FRAME_COLS MAP_WIDTH
+
+typedef struct
 {
-    if (foodIndex < 0 || foodIndex >= foodCount)
-        return;
+    WINDOW *win;   // ncurses backend
+    PANEL *panel;  // NULL for off-screen pads
+    chtype *cells; // memory backend, rows * cols
+    int rows, cols;
+    int top, left; // position on the screen
+    int cy, cx;    // cursor
+    attr_t attrs;
+} Surface;
 
-    Food food = foodInventory[foodIndex];
-    player->health += food.healthRestore;
-    if (player->health > 100)
-        player->health = 100;
+_Thread_local int screenRows = MAX_FRAME_ROWS, screenCols = MAX_FRAME_COLS;
+_Thread_local Surface *surfaceStack[MAX_SURFACES]; // bottom to top, memory backend only
+_Thread_local int surfaceCount = 0;
+_Thread_local chtype frameBuffer[MAX_FRAME_ROWS][MAX_FRAME_COLS];
+_Thread_local FILE *frameOut = NULL; // headless: every presented frame is written here
+_Thread_local long framesPresented = 0;
 
-    // Remove the consumed food from inventory
-    for (int i = foodIndex; i < foodCount - 1; i++)
+// A pad is off-screen (not stacked); a window is shown above earlier ones
+Surface *newSurface(int rows, int cols, int top, int left, bool onScreen)
+{
+    Surface *s = calloc(1, sizeof(Surface));
+    s->rows = rows;
+    s->cols = cols;
+    s->top = top;
+    s->left = left;
+    if (!headless)
     {
-        foodInventory[i] = foodInventory[i + 1];
+        s->win = onScreen ? newwin(rows, cols, top, left) : newpad(rows, cols);
+        keypad(s->win, TRUE);
+        if (onScreen)
+            s->panel = new_panel(s->win);
+        return s;
     }
-    foodCount--;
-}
-
-void placeWeapon(char map[MAP_HEIGHT][MAP_WIDTH], int x, int y, Weapon weapon)
-{
-    map[y][x] = weapon.icon; // Place the weapon icon on the map
+    s->cells = malloc(sizeof(chtype) * rows * cols);
+    for (int i = 0; i < rows * cols; i++)
+        s->cells[i] = ' ';
+    if (onScreen && surfaceCount < MAX_SURFACES)
+        surfaceStack[surfaceCount++] = s;
+    return s;
 }
 
-void placeWeapons(char map[MAP_HEIGHT][MAP_WIDTH])
+void freeSurface(Surface *s)
 {
-    int numWeapons = 5;
-    while (numWeapons > 0)
+    if (!headless)
     {
-        int x = rand() % MAP_WIDTH;
-        int y = rand() % MAP_HEIGHT;
-        // Place weapon only on floor tiles
-        if (map[y][x] == FLOOR)
+        if (s->panel)
+            del_panel(s->panel);
+        delwin(s->win);
+    }
+    else
+    {
+        for (int i = 0; i < surfaceCount; i++)
         {
-            Weapon weapon;
-            switch (rand() % 5)
+            if (surfaceStack[i] == s)
             {
-            case 0:
-                weapon = (Weapon){"Mace", WEAPON_ICON_MACE, 10};
-                break;
-            case 1:
-                weapon = (Weapon){"Dagger", WEAPON_ICON_DAGGER, 5};
-                break;
-            case 2:
-                weapon = (Weapon){"Wand", WEAPON_ICON_WAND, 8};
-                break;
-            case 3:
-                weapon = (Weapon){"Arrow", WEAPON_ICON_ARROW, 7};
-                break;
-            case 4:
-                weapon = (Weapon){"Sword", WEAPON_ICON_SWORD, 12};
+                // Keep the stacking order of the surfaces above it
+                memmove(&surfaceStack[i], &surfaceStack[i + 1], sizeof(surfaceStack[0]) * (surfaceCount - i - 1));
+                surfaceCount--;
                 break;
             }
-            placeWeapon(map, x, y, weapon);
-            numWeapons--;
         }
+        free(s->cells);
     }
+    free(s);
 }
 
-void collectItem(char map[MAP_HEIGHT][MAP_WIDTH], int x, int y)
+void surfPut(Surface *s, int y, int x, chtype ch)
 {
-    char cell = map[y][x];
-    if (cell == WEAPON_ICON_MACE || cell == WEAPON_ICON_DAGGER ||
-        cell == WEAPON_ICON_WAND || cell == WEAPON_ICON_ARROW ||
-        cell == WEAPON_ICON_SWORD)
+    if (!headless)
     {
-        // Determine which weapon it is, then add to inventory:
-        Weapon newWeapon;
-        if (cell == WEAPON_ICON_MACE)
-        {
-            newWeapon = (Weapon){"Mace", WEAPON_ICON_MACE, 10};
-        }
-        else if (cell == WEAPON_ICON_DAGGER)
-        {
-            newWeapon = (Weapon){"Dagger", WEAPON_ICON_DAGGER, 5};
-        }
-        else if (cell == WEAPON_ICON_WAND)
-        {
-            newWeapon = (Weapon){"Wand", WEAPON_ICON_WAND, 8};
-        }
-        else if (cell == WEAPON_ICON_ARROW)
-        {
-            newWeapon = (Weapon){"Arrow", WEAPON_ICON_ARROW, 7};
-        }
-        else if (cell == WEAPON_ICON_SWORD)
-        {
-            newWeapon = (Weapon){"Sword", WEAPON_ICON_SWORD, 12};
-        }
-
-        // Add to the inventory if under max count
-        if (weaponCount < MAX_WEAPON_ITEMS)
-        {
-            weaponInventory[weaponCount++] = newWeapon;
-            mvprintw(MAP_HEIGHT, 0, "Collected a %s", newWeapon.name);
-        }
-        // Remove the icon from the map
-        map[y][x] = FLOOR;
+        mvwaddch(s->win, y, x, ch);
+        return;
     }
-    // Handle other items (gold, food) similarly
-    // ...existing code...
+    if (y < 0 || y >= s->rows || x < 0 || x >= s->cols)
+        return;
+    s->cells[y * s->cols + x] = (ch & A_CHARTEXT) ? ch : (ch | ' ');
+    s->cy = y;
+    s->cx = x + 1;
 }
 
-void showWeaponInventory()
+// Write a run of ready-made cells in one call
+void surfPutRow(Surface *s, int y, int x, const chtype *run, int n)
 {
-    clear(); // Clear the current window or designate a separate window for the menu
-    mvprintw(0, 0, "Weapon Inventory:");
-    for (int i = 0; i < weaponCount; i++)
-    {
-        mvprintw(i + 1, 0, "%d. %s (%c)", i + 1, weaponInventory[i].name, weaponInventory[i].icon);
-    }
-    mvprintw(weaponCount + 2, 0, "Press the number of the weapon to equip it as your default.");
-    refresh();
-
-    // Wait for user input to switch weapons (if applicable)
-    int ch = getch();
-    // Assuming user inputs a valid number, update the default weapon accordingly.
-    if (ch >= '1' && ch <= '0' + weaponCount)
+    if (!headless)
     {
-        int index = ch - '1';
-        // update default or current weapon
-        // player.weapon = weaponInventory[index];
-        mvprintw(weaponCount + 3, 0, "Default weapon changed to: %s", weaponInventory[index].name);
-        refresh();
-        // Optionally wait for a moment before clearing the screen
+        mvwaddchnstr(s->win, y, x, run, n);
+        return;
     }
+    if (y < 0 || y >= s->rows || x < 0 || x >= s->cols)
+        return;
+    if (n > s->cols - x)
+        n = s->cols - x;
+    memcpy(&s->cells[y * s->cols + x], run, sizeof(chtype) * n);
 }
 
-void placeEnemiesInRoom(Room room, Enemy enemies[], int *enemyCount)
+chtype surfGet(Surface *s, int y, int x)
 {
-    if (*enemyCount >= MAX_ENEMIES)
-        return; // Ensure we do not exceed the maximum number of enemies
-
-    int enemyTypeIndex = rand() % 5; // Returns a number between 0 and 4
+    if (!headless)
+        return mvwinch(s->win, y, x);
+    if (y < 0 || y >= s->rows || x < 0 || x >= s->cols)
+        return ' ';
+    return s->cells[y * s->cols + x];
+}
 
-    Enemy enemy;
-    enemy.x = room.centerX; // or random placement within room boundaries
-    enemy.y = room.centerY;
-    enemy.type = (EnemyType)enemyTypeIndex;
-    enemy.isActive = 1;
+// Print at (y, x), or at the cursor when y is negative
+void surfPrint(Surface *s, int y, int x, const char *format, ...)
+{
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
 
-    switch (enemy.type)
+    if (!headless)
     {
-    case ENEMY_DEMON:
-        enemy.damageThreshold = 5;
-        enemy.chasingSteps = 0; // No special chasing duration
-        break;
-    case ENEMY_FIRE:
-        enemy.damageThreshold = 10;
-        enemy.chasingSteps = 0;
-        break;
-    case ENEMY_GIANT:
-        enemy.damageThreshold = 15;
-        enemy.chasingSteps = 5; // Giant chases for 5 steps
-        break;
-    case ENEMY_SNAKE:
-        enemy.damageThreshold = 20;
-        enemy.chasingSteps = -1; // Special marker (-1) maybe indicates unlimited chasing
-        break;
-    case ENEMY_UNDEAD:
-        enemy.damageThreshold = 30;
-        enemy.chasingSteps = 5; // Undead chases for 5 steps when adjacent
-        break;
+        if (y >= 0)
+            wmove(s->win, y, x);
+        waddstr(s->win, text);
+        return;
     }
-
-    enemies[(*enemyCount)++] = enemy;
+    if (y >= 0)
+    {
+        s->cy = y;
+        s->cx = x;
+    }
+    for (char *c = text; *c && s->cx < s->cols; c++)
+        surfPut(s, s->cy, s->cx, (unsigned char)*c | s->attrs);
 }
 
-void moveEnemyTowardsPlayer(Enemy *enemy, int playerX, int playerY, char map[MAP_HEIGHT][MAP_WIDTH])
+void surfAttr(Surface *s, attr_t attrs, bool on)
 {
-    if (!enemy->isActive)
+    if (!headless)
+    {
+        if (on)
+            wattron(s->win, attrs);
+        else
+            wattroff(s->win, attrs);
         return;
+    }
+    s->attrs = on ? (s->attrs | attrs) : (s->attrs & ~attrs);
+}
 
-    if (enemy->chasingSteps == 0)
+void surfClearToEol(Surface *s)
+{
+    if (!headless)
     {
+        wclrtoeol(s->win);
         return;
     }
+    for (int x = s->cx; x < s->cols; x++)
+        s->cells[s->cy * s->cols + x] = ' ';
+}
 
-    int dx = 0, dy = 0;
-    if (enemy->x < playerX)
-        dx = 1;
-    else if (enemy->x > playerX)
-        dx = -1;
-
-    if (enemy->y < playerY)
-        dy = 1;
-    else if (enemy->y > playerY)
-        dy = -1;
-
-    if (isWalkable(map, enemy->x + dx, enemy->y + dy))
+void surfErase(Surface *s)
+{
+    if (!headless)
     {
-        enemy->x += dx;
-        enemy->y += dy;
+        werase(s->win);
+        return;
     }
-
-    if (enemy->chasingSteps > 0)
-        enemy->chasingSteps--;
+    for (int i = 0; i < s->rows * s->cols; i++)
+        s->cells[i] = ' ';
+    s->cy = s->cx = 0;
 }
 
-void processCombat(Player *player, Enemy *enemy, int weaponDamage)
+// Scroll the contents up by n rows (down when n is negative)
+void surfScroll(Surface *s, int n)
 {
-    enemy->damageThreshold -= weaponDamage;
-
-    if (enemy->damageThreshold <= 0)
+    if (!headless)
     {
-        displayMessage("You have defeated the enemy!");
-        enemy->isActive = 0;
+        scrollok(s->win, TRUE);
+        wscrl(s->win, n);
+        scrollok(s->win, FALSE);
+        return;
+    }
+    for (int row = 0; row < s->rows; row++)
+    {
+        int from = n > 0 ? row + n : s->rows - 1 - row + n;
+        int to = n > 0 ? row : s->rows - 1 - row;
+        for (int col = 0; col < s->cols; col++)
+            s->cells[to * s->cols + col] = (from >= 0 && from < s->rows) ? s->cells[from * s->cols + col] : ' ';
+    }
+}
+
+// Shift one row left by n cells (right when n is negative), blank-filling
+void surfShiftRow(Surface *s, int row, int n)
+{
+    for (int i = 0; i < abs(n); i++)
+    {
+        if (!headless)
+        {
+            wmove(s->win, row, 0);
+            if (n > 0)
+                wdelch(s->win);
+            else
+                winsch(s->win, ' ');
+            continue;
+        }
+        chtype *line = &s->cells[row * s->cols];
+        if (n > 0)
+        {
+            for (int col = 0; col < s->cols - 1; col++)
+                line[col] = line[col + 1];
+            line[s->cols - 1] = ' ';
+        }
+        else
+        {
+            for (int col = s->cols - 1; col > 0; col--)
+                line[col] = line[col - 1];
+            line[0] = ' ';
+        }
+    }
+}
+
+// Same arguments as copywin(): source origin, then destination rectangle
+void surfCopy(Surface *src, Surface *dst, int srow, int scol, int drow, int dcol, int drow2, int dcol2)
+{
+    if (!headless)
+    {
+        copywin(src->win, dst->win, srow, scol, drow, dcol, drow2, dcol2, FALSE);
+        return;
+    }
+    for (int row = drow; row <= drow2; row++)
+        surfPutRow(dst, row, dcol, &src->cells[(srow + row - drow) * src->cols + scol], dcol2 - dcol + 1);
+}
+
+void surfBox(Surface *s)
+{
+    if (!headless)
+    {
+        box(s->win, 0, 0);
+        return;
+    }
+    for (int col = 0; col < s->cols; col++)
+    {
+        surfPut(s, 0, col, '-');
+        surfPut(s, s->rows - 1, col, '-');
+    }
+    for (int row = 0; row < s->rows; row++)
+    {
+        surfPut(s, row, 0, '|');
+        surfPut(s, row, s->cols - 1, '|');
+    }
+}
+
+// Input for the whole game. Headless runs read a key script from stdin,
+// where arrow keys are written as the usual ESC [ A..D sequences.
+_Thread_local int pushedBackKey = ERR;
+int (*keySource)() = NULL; // a bot player, when one is playing (see BOTS)
+
+int readKey(Surface *s)
+{
+    if (pushedBackKey != ERR)
+    {
+        int c = pushedBackKey;
+        pushedBackKey = ERR;
+        return c;
+    }
+    if (keySource)
+        return keySource();
+    if (!headless)
+        return s ? wgetch(s->win) : getch();
+
+    int c = getchar();
+    if (c == EOF)
+        return 'q';
+    if (c == 27)
+    {
+        int next = getchar();
+        if (next != '[' && next != 'O')
+        {
+            if (next != EOF)
+                ungetc(next, stdin);
+            return 27;
+        }
+        // Shifted arrows come as ESC [ 1 ; 2 A..D
+        bool shifted = false;
+        int final = getchar();
+        while (final != EOF && ((final >= '0' && final <= '9') || final == ';'))
+        {
+            if (final == '2')
+                shifted = true;
+            final = getchar();
+        }
+        switch (final)
+        {
+        case 'A':
+            return shifted ? KEY_SR : KEY_UP;
+        case 'B':
+            return shifted ? KEY_SF : KEY_DOWN;
+        case 'C':
+            return shifted ? KEY_SRIGHT : KEY_RIGHT;
+        case 'D':
+            return shifted ? KEY_SLEFT : KEY_LEFT;
+        }
+        return ERR;
+    }
+    return c;
+}
+
+// A key that is already waiting, or ERR. Headless key scripts have no notion
+// of typing ahead, so there nothing is ever waiting.
+int pollKey()
+{
+    if (pushedBackKey != ERR)
+        return readKey(NULL);
+    if (headless)
+        return ERR;
+    nodelay(stdscr, TRUE);
+    int c = getch();
+    nodelay(stdscr, FALSE);
+    return c;
+}
+
+void setInputTimeout(int ms)
+{
+    if (!headless)
+        timeout(ms);
+}
+
+void waitMs(int ms)
+{
+    if (!headless && !realTime)
+        napms(ms);
+}
+
+void dumpFrame(FILE *out)
+{
+    fprintf(out, "---- frame %ld ----\n", framesPresented);
+    for (int row = 0; row < screenRows; row++)
+    {
+        for (int col = 0; col < screenCols; col++)
+            fputc((int)(frameBuffer[row][col] & A_CHARTEXT), out);
+        fputc('\n', out);
+    }
+}
+
+// Send everything drawn since the last frame to the screen in one go
+void presentFrame()
+{
+    framesPresented++;
+    if (!drawFrames)
+        return;
+    if (!headless)
+    {
+        update_panels();
+        doupdate();
+        return;
+    }
+    for (int row = 0; row < screenRows; row++)
+        for (int col = 0; col < screenCols; col++)
+            frameBuffer[row][col] = ' ';
+    for (int i = 0; i < surfaceCount; i++)
+    {
+        Surface *s = surfaceStack[i];
+        for (int row = 0; row < s->rows; row++)
+            for (int col = 0; col < s->cols; col++)
+                if (s->top + row < screenRows && s->left + col < screenCols)
+                    frameBuffer[s->top + row][s->left + col] = s->cells[row * s->cols + col];
+    }
+    if (frameOut)
+        dumpFrame(frameOut);
+}
+
+//----------------------------------------------------------------------------
+// VISIBILITY
+//----------------------------------------------------------------------------
+// Terrain the player has seen is drawn once into an off-screen pad. Only
+// cells that get revealed or whose contents change are redrawn there; every
+// frame just copies the pad and overlays the few moving things on top.
+_Thread_local Surface *terrainPad = NULL;
+
+void forgetPathsNear(int x, int y);
+
+void revealCell(CellSet *visible, int x, int y)
+{
+    addCell(visible, x, y);
+    if (!hasCell(&explored, x, y))
+    {
+        addCell(&explored, x, y);
+        markCellDirty(x, y);
+        setGridBit(frontierStaleRows, STALE_ROW_WORDS, y, 0, true);
+        forgetPathsNear(x, y);
+    }
+}
+
+//----------------------------------------------------------------------------
+// VIEWPORT
+//----------------------------------------------------------------------------
+// The part of the map that fits on the terminal is shown in mapWin, with the
+// camera at (camX, camY). When the camera moves by a little, the window is
+// scrolled (rows) or its lines are shifted (columns) and only the newly
+// exposed strip is copied from the pad, so the terminal receives a scroll
+// or insert/delete instead of a full repaint.
+#define VIEW_MARGIN 4 // faseleye bazikon ta labe ghabl az harekat dadan dorbin
+#define MAX_OVERLAYS (MAX_ENEMIES + MAX_PROJECTILES + 1)
+
+_Thread_local Surface *mapWin = NULL;
+_Thread_local Surface *msgWin = NULL;    // payam zir naghshe
+_Thread_local Surface *statusWin = NULL; // salamat, tala, goshnegi
+_Thread_local int viewWidth = MAP_WIDTH, viewHeight = MAP_HEIGHT;
+_Thread_local int camX = 0, camY = 0;
+_Thread_local int overlayCells[MAX_OVERLAYS]; // map cells covered by an entity last frame
+_Thread_local int overlayCount = 0;
+
+// The map, message and status windows sit at the bottom of the surface
+// stack; menus are pushed on top as overlays, so closing one only repaints
+// the rectangle it covered and all windows go out in one presentFrame()
+void initViewport()
+{
+    if (!headless)
+    {
+        screenRows = LINES;
+        screenCols = COLS;
+    }
+    viewWidth = screenCols < MAP_WIDTH ? screenCols : MAP_WIDTH;
+    viewHeight = screenRows - 2 < MAP_HEIGHT ? screenRows - 2 : MAP_HEIGHT;
+    terrainPad = newSurface(MAP_HEIGHT, MAP_WIDTH, 0, 0, false);
+    mapWin = newSurface(viewHeight, viewWidth, 0, 0, true);
+    msgWin = newSurface(1, screenCols, viewHeight, 0, true);
+    statusWin = newSurface(1, screenCols, viewHeight + 1, 0, true);
+    if (!headless)
+    {
+        idlok(mapWin->win, TRUE); // let ncurses use the terminal's insert/delete line
+        idcok(mapWin->win, TRUE);
+    }
+}
+
+void showMessageNow(const char *message, attr_t attrs)
+{
+    surfAttr(msgWin, attrs, true);
+    surfPrint(msgWin, 0, 0, "%s", message);
+    surfAttr(msgWin, attrs, false);
+    surfClearToEol(msgWin);
+    presentFrame();
+}
+
+bool inViewport(int x, int y)
+{
+    return x >= camX && x < camX + viewWidth && y >= camY && y < camY + viewHeight;
+}
+
+// Copy a rectangle of map cells (in map coordinates) from the pad
+void copyPadToView(int x0, int y0, int x1, int y1)
+{
+    surfCopy(terrainPad, mapWin, y0, x0, y0 - camY, x0 - camX, y1 - camY, x1 - camX);
+}
+
+void restorePadCell(int x, int y)
+{
+    if (inViewport(x, y))
+        surfPut(mapWin, y - camY, x - camX, surfGet(terrainPad, y, x));
+}
+
+int clampCamera(int cam, int player, int view, int size)
+{
+    if (player < cam + VIEW_MARGIN)
+        cam = player - VIEW_MARGIN;
+    else if (player >= cam + view - VIEW_MARGIN)
+        cam = player - view + VIEW_MARGIN + 1;
+    if (cam > size - view)
+        cam = size - view;
+    if (cam < 0)
+        cam = 0;
+    return cam;
+}
+
+// Follow the player, sending only the strip that scrolled into view
+void moveCamera()
+{
+    int newCamX = clampCamera(camX, playerX, viewWidth, MAP_WIDTH);
+    int newCamY = clampCamera(camY, playerY, viewHeight, MAP_HEIGHT);
+    int dx = newCamX - camX, dy = newCamY - camY;
+    if (dx == 0 && dy == 0)
+        return;
+
+    // Big jumps are cheaper as a plain repaint
+    if (abs(dx) >= viewWidth / 2 || abs(dy) >= viewHeight / 2)
+    {
+        camX = newCamX;
+        camY = newCamY;
+        copyPadToView(camX, camY, camX + viewWidth - 1, camY + viewHeight - 1);
+        return;
+    }
+
+    if (dy != 0)
+    {
+        surfScroll(mapWin, dy);
+        camY = newCamY;
+        if (dy > 0)
+            copyPadToView(camX, camY + viewHeight - dy, camX + viewWidth - 1, camY + viewHeight - 1);
+        else
+            copyPadToView(camX, camY, camX + viewWidth - 1, camY - dy - 1);
+    }
+
+    if (dx != 0)
+    {
+        for (int row = 0; row < viewHeight; row++)
+            surfShiftRow(mapWin, row, dx);
+        camX = newCamX;
+        if (dx > 0)
+            copyPadToView(camX + viewWidth - dx, camY, camX + viewWidth - 1, camY + viewHeight - 1);
+        else
+            copyPadToView(camX, camY, camX - dx - 1, camY + viewHeight - 1);
+    }
+}
+
+// Redraw the changed cells into the terrain pad and the visible part of them
+// into the viewport. Cells revealed together lie next to each other in the
+// dirty list, so they are gathered into runs and written a row piece at a time.
+void flushTerrainPad(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    chtype run[MAP_WIDTH];
+    int runLength = 0, runRow = 0, runCol = 0;
+    for (int i = 0; i <= dirtyCount; i++)
+    {
+        int row = -1, col = -1;
+        if (i < dirtyCount)
+        {
+            row = dirtyCells[i] / MAP_WIDTH;
+            col = dirtyCells[i] % MAP_WIDTH;
+            cellDirty[row][col] = false;
+            if (!hasCell(&explored, col, row))
+                continue;
+        }
+
+        // Flush the current run when this cell does not continue it
+        if (runLength > 0 && (row != runRow || col != runCol + runLength))
+        {
+            surfPutRow(terrainPad, runRow, runCol, run, runLength);
+            int y = runRow - camY;
+            int x0 = runCol > camX ? runCol : camX;
+            int x1 = runCol + runLength < camX + viewWidth ? runCol + runLength : camX + viewWidth;
+            if (y >= 0 && y < viewHeight && x0 < x1)
+                surfPutRow(mapWin, y, x0 - camX, &run[x0 - runCol], x1 - x0);
+            runLength = 0;
+        }
+        if (row == -1)
+            break;
+
+        if (runLength == 0)
+        {
+            runRow = row;
+            runCol = col;
+        }
+        run[runLength++] = itemAt[row][col] != -1 ? itemCell(&itemPool[itemAt[row][col]]) : tileCell[map[row][col]];
+    }
+    dirtyCount = 0;
+}
+
+void drawOverlay(int x, int y, chtype glyph)
+{
+    if (!inViewport(x, y) || overlayCount >= MAX_OVERLAYS)
+        return;
+    surfPut(mapWin, y - camY, x - camX, glyph);
+    overlayCells[overlayCount++] = y * MAP_WIDTH + x;
+}
+
+//----------------------------------------------------------------------------
+// OVERLAY WINDOWS
+//----------------------------------------------------------------------------
+Surface *openOverlay(int height, int width)
+{
+    if (height > viewHeight)
+        height = viewHeight;
+    if (width > viewWidth)
+        width = viewWidth;
+    Surface *win = newSurface(height, width, (viewHeight - height) / 2, (viewWidth - width) / 2, true);
+    surfBox(win);
+    return win;
+}
+
+// Show the overlay and wait for a key
+int overlayGetch(Surface *win)
+{
+    presentFrame();
+    return readKey(win);
+}
+
+void closeOverlay(Surface *win)
+{
+    freeSurface(win);
+    presentFrame();
+}
+
+//----------------------------------------------------------------------------
+// FIELD OF VIEW
+//----------------------------------------------------------------------------
+// What the player sees is worked out by recursive shadowcasting: each of
+// the eight octants is scanned row by row away from the player, and every
+// cell that stops sight narrows the range of slopes the rows behind it are
+// scanned over (a new range is started for each gap). Only cells within
+// fovRadius (--fov-radius) and not in shadow are ever looked at, so the
+// cost follows the visible area, not the map. Slopes and row widths do not
+// depend on where the player stands and are worked out once.
+#define FOV_MAX_RADIUS 20
+#define FOV_RADIUS 9
+
+int fovRadius = FOV_RADIUS;
+float fovSlopeLow[FOV_MAX_RADIUS + 1][FOV_MAX_RADIUS + 1];  // [row][col]: where a cell starts...
+float fovSlopeHigh[FOV_MAX_RADIUS + 1][FOV_MAX_RADIUS + 1]; // ...and ends, as col/row
+int fovRowWidth[FOV_MAX_RADIUS + 1];                         // last column inside the radius
+
+// Octant o maps (row, col) to the cell row * rowStep + col * colStep away
+static const int octantRowX[8] = {0, 0, 1, 1, 0, 0, -1, -1};
+static const int octantRowY[8] = {-1, -1, 0, 0, 1, 1, 0, 0};
+static const int octantColX[8] = {1, -1, 0, 0, 1, -1, 0, 0};
+static const int octantColY[8] = {0, 0, 1, -1, 0, 0, 1, -1};
+
+void initFieldOfView(int radius)
+{
+    fovRadius = radius < 1 ? 1 : radius > FOV_MAX_RADIUS ? FOV_MAX_RADIUS : radius;
+    for (int row = 1; row <= FOV_MAX_RADIUS; row++)
+    {
+        fovRowWidth[row] = -1;
+        for (int col = 0; col <= row; col++)
+        {
+            fovSlopeLow[row][col] = (col - 0.5f) / (row + 0.5f);
+            fovSlopeHigh[row][col] = (col + 0.5f) / (row - 0.5f);
+            if (col * col + row * row <= fovRadius * fovRadius + fovRadius)
+                fovRowWidth[row] = col;
+        }
+    }
+}
+
+// Light one octant from the given row on, between slopes low and high
+void castLight(Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible, int octant, int row, float low, float high)
+{
+    for (; row <= fovRadius && low <= high; row++)
+    {
+        bool blocked = false;
+        float nextLow = low;
+        int baseX = playerX + row * octantRowX[octant], baseY = playerY + row * octantRowY[octant];
+        for (int col = 0; col <= fovRowWidth[row]; col++)
+        {
+            if (fovSlopeHigh[row][col] < low)
+                continue;
+            if (fovSlopeLow[row][col] > high)
+                break;
+            int x = baseX + col * octantColX[octant], y = baseY + col * octantColY[octant];
+            bool opaque = x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT;
+            if (!opaque)
+            {
+                revealCell(visible, x, y);
+                opaque = !TILE_HAS(map[y][x], TF_TRANSPARENT);
+            }
+
+            if (blocked)
+            {
+                if (opaque)
+                    nextLow = fovSlopeHigh[row][col];
+                else
+                {
+                    blocked = false;
+                    low = nextLow;
+                }
+            }
+            else if (opaque)
+            {
+                blocked = true;
+                castLight(map, visible, octant, row + 1, low, fovSlopeLow[row][col]);
+                nextLow = fovSlopeHigh[row][col];
+            }
+        }
+        if (blocked)
+            return;
+    }
+}
+
+void updateVisibility(Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible)
+{
+    clearCells(visible);
+    revealCell(visible, playerX, playerY);
+    for (int octant = 0; octant < 8; octant++)
+        castLight(map, visible, octant, 1, 0.0f, 1.0f);
+}
+
+void drawStatus(Player *player)
+{
+    surfErase(statusWin);
+    char where[32];
+    if (overworld)
+        snprintf(where, sizeof(where), "At:%d,%d", worldLeft + playerX, worldTop + playerY);
+    else
+        snprintf(where, sizeof(where), "Floor:%d", currentFloor);
+    surfPrint(statusWin, 0, 0, "%s  HP:%d  Gold:%d  Hunger:%d  Weapon:%s  Turn:%ld",
+              where, player->health, playerGold, player->hunger,
+              allWeaponTypes[currentWeaponType].name, currentTurn);
+    if (tickBudgetUs > 0 && tickLastUs >= 0)
+        surfPrint(statusWin, -1, 0, "  Tick:%ldus/%ldms", tickLastUs, tickBudgetUs / 1000);
+}
+
+// Visibility only changes when the player moves (or changes floors, which
+// sets visX back to -1)
+_Thread_local int visX = -1, visY = -1;
+
+void refreshVisibility(Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible)
+{
+    if (playerX != visX || playerY != visY)
+    {
+        updateVisibility(map, visible);
+        visX = playerX;
+        visY = playerY;
+    }
+}
+
+//----------------------------------------------------------------------------
+// LINE OF SIGHT
+//----------------------------------------------------------------------------
+// A monster notices the player only by seeing them: along a straight line
+// from the player to its cell, through cells that let sight pass, and no
+// farther than the player sees (fovRadius). The answer is kept for the
+// monster's cell until the player moves or the level changes, so monsters
+// that stand still, or ask again within a turn, trace no new line.
+_Thread_local int sightStamp[MAP_HEIGHT * MAP_WIDTH]; // sightGeneration of the answer kept
+_Thread_local bool sightAnswer[MAP_HEIGHT * MAP_WIDTH];
+_Thread_local int sightGeneration = 1;
+_Thread_local int sightPlayerCell = -1;
+_Thread_local int noticedPlayerCell = -1; // where the sleepers last looked for the player
+_Thread_local long sightQueries = 0, sightTraced = 0; // lines actually followed
+
+// The terrain changed under the kept answers (a new level)
+void forgetSight()
+{
+    sightGeneration++;
+    noticedPlayerCell = -1;
+}
+
+// Bresenham from (x0, y0) to (x1, y1); only the cells between must be clear
+bool traceSight(Tile map[MAP_HEIGHT][MAP_WIDTH], int x0, int y0, int x1, int y1)
+{
+    sightTraced++;
+    int dx = abs(x1 - x0), dy = -abs(y1 - y0);
+    int sx = x0 < x1 ? 1 : -1, sy = y0 < y1 ? 1 : -1;
+    int error = dx + dy;
+    while (true)
+    {
+        int twice = 2 * error;
+        if (twice >= dy)
+        {
+            error += dy;
+            x0 += sx;
+        }
+        if (twice <= dx)
+        {
+            error += dx;
+            y0 += sy;
+        }
+        if (x0 == x1 && y0 == y1)
+            return true;
+        if (!TILE_HAS(map[y0][x0], TF_TRANSPARENT))
+            return false;
+    }
+}
+
+// Whether a monster standing at (x, y) sees the player
+bool playerInSight(Tile map[MAP_HEIGHT][MAP_WIDTH], int x, int y)
+{
+    sightQueries++;
+    int player = playerY * MAP_WIDTH + playerX;
+    if (player != sightPlayerCell)
+    {
+        sightPlayerCell = player;
+        sightGeneration++;
+    }
+    int cell = y * MAP_WIDTH + x;
+    if (sightStamp[cell] != sightGeneration)
+    {
+        int dx = x - playerX, dy = y - playerY;
+        sightAnswer[cell] = cell == player || (dx * dx + dy * dy <= fovRadius * fovRadius + fovRadius &&
+                                               traceSight(map, playerX, playerY, x, y));
+        sightStamp[cell] = sightGeneration;
+    }
+    return sightAnswer[cell];
+}
+
+int countVisibleEnemies(CellSet *visible)
+{
+    int count = 0;
+    for (int i = 0; i < enemyCount; i++)
+        if (enemies[i].isActive && hasCell(visible, enemies[i].x, enemies[i].y))
+            count++;
+    return count;
+}
+
+void printDungeon(Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible, Player *player)
+{
+    refreshVisibility(map, visible);
+    if (!drawFrames)
+        return;
+
+    // Terrain layer: scroll the view, put back what last frame's entities
+    // covered and bring the changed cells up to date
+    moveCamera();
+    for (int i = 0; i < overlayCount; i++)
+        restorePadCell(overlayCells[i] % MAP_WIDTH, overlayCells[i] / MAP_WIDTH);
+    overlayCount = 0;
+    flushTerrainPad(map);
+
+    // Print the enemies
+    for (int i = 0; i < enemyCount; i++)
+    {
+        if (enemies[i].isActive && hasCell(visible, enemies[i].x, enemies[i].y))
+            drawOverlay(enemies[i].x, enemies[i].y, enemyCell[enemies[i].type]);
+    }
+
+    // Print the projectiles in flight
+    for (int i = 0; i < MAX_PROJECTILES; i++)
+    {
+        if (projectiles[i].active && hasCell(visible, projectiles[i].x, projectiles[i].y))
+            drawOverlay(projectiles[i].x, projectiles[i].y, allWeaponTypes[projectiles[i].weapon].icon | A_BOLD);
+    }
+
+    // Print the player
+    drawOverlay(playerX, playerY, PLAYER_CELL);
+    surfPrint(msgWin, 0, 0, "%s", messageLine);
+    surfClearToEol(msgWin);
+    drawStatus(player);
+
+    // Map, message and status reach the terminal in one write
+    presentFrame();
+}
+
+// tabe gharar dadan tala rooye naghshe (tala adi)
+void placeRegularGold(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    int numGoldBags = 20;
+    while (numGoldBags > 0)
+    {
+        int x = randomInt() % MAP_WIDTH;
+        int y = randomInt() % MAP_HEIGHT;
+        // faghat agar makani kaf (FLOOR) dashte bashad
+        if (map[y][x] == TILE_FLOOR && dropItem(x, y, ITEM_GOLD, 0, 1))
+        {
+            numGoldBags--;
+        }
+    }
+}
+
+// tabe gharar dadan talaye siyah rooye naghshe
+void placeBlackGold(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    int numBlackGoldBags = 5;
+    while (numBlackGoldBags > 0)
+    {
+        int x = randomInt() % MAP_WIDTH;
+        int y = randomInt() % MAP_HEIGHT;
+        // tala rooye kaf otagh gharar girad
+        if (map[y][x] == TILE_FLOOR && dropItem(x, y, ITEM_BLACK_GOLD, 0, 1))
+        {
+            numBlackGoldBags--;
+        }
+    }
+}
+
+void display_final_score()
+{
+    Surface *win = openOverlay(5, 30);
+    surfAttr(win, A_BOLD, true);
+    surfPrint(win, 1, 2, "bazi be payan resid!");
+    surfPrint(win, 2, 2, "kol tala: %d", playerGold);
+    surfPrint(win, 3, 2, "emtiyaz shoma: %d", playerGold);
+    surfAttr(win, A_BOLD, false);
+    overlayGetch(win);
+    closeOverlay(win);
+}
+
+// Most food is common; one in five is superior and one in ten magic
+FoodType randomFoodType()
+{
+    int roll = randomInt() % 10;
+    return roll == 0 ? MAGIC_FOOD : roll <= 2 ? SUPERIOR_FOOD : COMMON_FOOD;
+}
+
+void placeFood(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    int numFoodItems = 10;
+    while (numFoodItems > 0)
+    {
+        int x = randomInt() % MAP_WIDTH;
+        int y = randomInt() % MAP_HEIGHT;
+        // Place food only on floor tiles
+        if (map[y][x] == TILE_FLOOR && dropItem(x, y, ITEM_FOOD, randomFoodType(), 1))
+        {
+            numFoodItems--;
+        }
+    }
+}
+
+void showFoodMenu(Player *player)
+{
+    Surface *win = openOverlay(foodCount + 6, 72);
+    int line = 1;
+
+    // namayesh navare goshnegi
+    surfPrint(win, line, 2, "sathe goshnegi: [");
+    for (int i = 0; i < 10; i++)
+    {
+        if ((player->hunger / 10) > i)
+            surfPrint(win, -1, 0, "#");
+        else
+            surfPrint(win, -1, 0, "-");
+    }
+    surfPrint(win, -1, 0, "]");
+    line++;
+
+    // namayesh liste ghazahaye mojood
+    surfPrint(win, line++, 2, "mojoodi ghaza:");
+    for (int i = 0; i < foodCount; i++)
+    {
+        surfPrint(win, line++, 2, "%d: ", i + 1);
+        switch (foodInventory[i].type)
+        {
+        case COMMON_FOOD:
+            surfPrint(win, -1, 0, "ghazaye mamooli (bazgardani salamat: %d)", foodInventory[i].healthRestore);
+            break;
+        case SUPERIOR_FOOD:
+            surfPrint(win, -1, 0, "ghazaye momtaz (bazgardani salamat: %d)", foodInventory[i].healthRestore);
+            break;
+        case MAGIC_FOOD:
+            surfPrint(win, -1, 0, "ghazaye jadooyi (bazgardani salamat: %d)", foodInventory[i].healthRestore);
+            break;
+        case CORRUPTED_FOOD:
+            surfPrint(win, -1, 0, "ghazaye fased shode (bazgardani salamat: %d, ehtiat!)", foodInventory[i].healthRestore);
+            break;
+        }
+    }
+    surfPrint(win, line++, 2, "shomare ghaza baraye masraf, ya har kelide digar baraye khorooj.");
+
+    // daryaft voroodi karbar va pardazesh entekhab
+    int choice = overlayGetch(win) - '1';
+    closeOverlay(win);
+    if (choice >= 0 && choice < foodCount)
+    {
+        consumeFood(player, choice);
+    }
+}
+
+void consumeFood(Player *player, int foodIndex)
+{
+    if (foodIndex < 0 || foodIndex >= foodCount)
+        return;
+
+    Food food = foodInventory[foodIndex];
+    player->health += food.healthRestore;
+    if (player->health > 100)
+        player->health = 100;
+
+    // ghaza goshnegi ra kam mikonad
+    player->hunger -= 30;
+    if (player->hunger < 0)
+        player->hunger = 0;
+
+    // ghazaye momtaz va jadooyi baraye modati zarbe ra ghavi tar mikonand
+    int bonus = 0;
+    if (food.type == SUPERIOR_FOOD)
+        bonus = 5;
+    else if (food.type == MAGIC_FOOD)
+        bonus = 10;
+    if (bonus > 0 && scheduleEvent(currentTurn + FOOD_EFFECT_DURATION, EV_FOOD_EFFECT_END, bonus))
+        playerDamageBonus += bonus;
+
+    // Remove the consumed food from inventory
+    for (int i = foodIndex; i < foodCount - 1; i++)
+    {
+        foodInventory[i] = foodInventory[i + 1];
+    }
+    foodCount--;
+}
+
+void placeWeapon(int x, int y, WeaponType type)
+{
+    dropItem(x, y, ITEM_WEAPON, type, allWeaponTypes[type].defaultQuantity);
+}
+
+void placeWeapons(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    int numWeapons = 5;
+    while (numWeapons > 0)
+    {
+        int x = randomInt() % MAP_WIDTH;
+        int y = randomInt() % MAP_HEIGHT;
+        // Place weapon only on floor tiles
+        if (map[y][x] == TILE_FLOOR)
+        {
+            placeWeapon(x, y, (WeaponType)(randomInt() % MAX_WEAPON_TYPES));
+            numWeapons--;
+        }
+    }
+}
+
+// Move one item stack into the player's inventories.
+// Returns false if it has to stay on the floor (e.g. no room for food).
+bool collectItem(Player *player, Item *item)
+{
+    switch (item->kind)
+    {
+    case ITEM_GOLD:
+    case ITEM_BLACK_GOLD:
+    {
+        int gold = item->quantity * (item->kind == ITEM_GOLD ? GOLD_VALUE : BLACK_GOLD_VALUE);
+        playerGold += gold;
+        setMessage("You picked up %d gold. You have %d now.", gold, playerGold);
+        return true;
+    }
+    case ITEM_FOOD:
+    {
+        int before = foodCount;
+        while (item->quantity > 0 && foodCount < MAX_FOOD_ITEMS)
+        {
+            foodInventory[foodCount++] = (Food){player->x, player->y, item->subtype, foodHealthRestore[item->subtype]};
+            item->quantity--;
+        }
+        // What is left is reported by lookAt
+        if (foodCount > before)
+            setMessage("You picked up some food.");
+        return item->quantity == 0;
+    }
+    case ITEM_WEAPON:
+    {
+        Weapon *wpn = &allWeaponTypes[item->subtype];
+        if (wpn->permanent)
+            playerInventory[item->subtype].quantity = 1;
+        else
+            playerInventory[item->subtype].quantity += item->quantity;
+        if (weaponCount < MAX_WEAPON_ITEMS)
+            weaponInventory[weaponCount++] = *wpn;
+        setMessage("You picked up %s! Quantity now: %d", wpn->name, playerInventory[item->subtype].quantity);
+        return true;
+    }
+    }
+    return false;
+}
+
+// Stacks picked up so far; a batch of moves compares it before and after a turn
+_Thread_local int itemsCollected = 0;
+
+void pickUpItemsAt(Player *player, int x, int y)
+{
+    int *link = &itemAt[y][x];
+    while (*link != -1)
+    {
+        int id = *link;
+        if (collectItem(player, &itemPool[id]))
+        {
+            *link = itemPool[id].next;
+            freeItem(id);
+            itemsCollected++;
+        }
+        else
+        {
+            link = &itemPool[id].next;
+        }
+    }
+    markCellDirty(x, y);
+}
+
+// Describe what is left lying on a cell
+void lookAt(int x, int y)
+{
+    int id = itemAt[y][x];
+    if (id == -1)
+        return;
+    int count = 0;
+    for (int i = id; i != -1; i = itemPool[i].next)
+        count++;
+    setMessage("You see %c here%s.", itemGlyph(&itemPool[id]), count > 1 ? " (and more)" : "");
+}
+
+void showWeaponInventory()
+{
+    Surface *win = openOverlay(weaponCount + 5, 64);
+    surfPrint(win, 1, 2, "Weapon Inventory:");
+    for (int i = 0; i < weaponCount; i++)
+    {
+        surfPrint(win, i + 2, 2, "%d. %s (%c)", i + 1, weaponInventory[i].name, weaponInventory[i].icon);
+    }
+    surfPrint(win, weaponCount + 3, 2, "Press the number of the weapon to equip it as your default.");
+
+    // Wait for user input to switch weapons (if applicable)
+    int ch = overlayGetch(win);
+    closeOverlay(win);
+    // Assuming user inputs a valid number, update the default weapon accordingly.
+    if (ch >= '1' && ch <= '0' + weaponCount)
+    {
+        int index = ch - '1';
+        // update default or current weapon
+        // player.weapon = weaponInventory[index];
+        setMessage("Default weapon changed to: %s", weaponInventory[index].name);
+    }
+}
+
+// A fresh monster of the given type, asleep until it sees the player
+Enemy makeEnemy(EnemyType type, int x, int y)
+{
+    Enemy enemy;
+    enemy.x = x;
+    enemy.y = y;
+    enemy.type = type;
+    enemy.isActive = 0;
+    enemy.stunnedUntil = 0;
+    enemy.scheduled = false;
+    switch (enemy.type)
+    {
+    case ENEMY_DEMON:
+        enemy.damageThreshold = 5;
+        enemy.chasingSteps = 0; // No special chasing duration
+        enemy.actionDelay = 1;
+        break;
+    case ENEMY_FIRE:
+        enemy.damageThreshold = 10;
+        enemy.chasingSteps = 0;
+        enemy.actionDelay = 1;
+        break;
+    case ENEMY_GIANT:
+        enemy.damageThreshold = 15;
+        enemy.chasingSteps = 5; // Giant chases for 5 steps
+        enemy.actionDelay = 2;  // Giants are slow
+        break;
+    case ENEMY_SNAKE:
+        enemy.damageThreshold = 20;
+        enemy.chasingSteps = -1; // Special marker (-1) maybe indicates unlimited chasing
+        enemy.actionDelay = 1;
+        break;
+    case ENEMY_UNDEAD:
+        enemy.damageThreshold = 30;
+        enemy.chasingSteps = 5; // Undead chases for 5 steps when adjacent
+        enemy.actionDelay = 2;
+        break;
+    }
+    enemy.maxDamageThreshold = enemy.damageThreshold;
+    return enemy;
+}
+
+void placeEnemiesInRoom(Room room, Enemy enemies[], int *enemyCount)
+{
+    // Reuse the slot of a dead enemy that has no pending turn event
+    int slot = *enemyCount;
+    for (int i = 0; i < *enemyCount; i++)
+    {
+        if (enemies[i].damageThreshold <= 0 && !enemies[i].scheduled)
+        {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= MAX_ENEMIES)
+        return; // Ensure we do not exceed the maximum number of enemies
+
+    int enemyTypeIndex = randomInt() % 5; // Returns a number between 0 and 4
+
+    // or random placement within room boundaries
+    Enemy enemy = makeEnemy((EnemyType)enemyTypeIndex, room.centerX, room.centerY);
+    if (enemyAt[enemy.y][enemy.x] != -1)
+        return; // Someone is already standing at the spawn point
+
+    enemies[slot] = enemy;
+    enemyAt[enemy.y][enemy.x] = slot;
+    if (slot == *enemyCount)
+        (*enemyCount)++;
+}
+
+void moveEnemyTowardsPlayer(Enemy *enemy, int playerX, int playerY, Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    if (!enemy->isActive)
+        return;
+
+    if (enemy->chasingSteps == 0)
+    {
+        return;
+    }
+
+    int dx = 0, dy = 0;
+    if (enemy->x < playerX)
+        dx = 1;
+    else if (enemy->x > playerX)
+        dx = -1;
+
+    if (enemy->y < playerY)
+        dy = 1;
+    else if (enemy->y > playerY)
+        dy = -1;
+
+    int nx = enemy->x + dx;
+    int ny = enemy->y + dy;
+    if (isWalkable(map, nx, ny) && enemyAt[ny][nx] == -1)
+        moveEnemyTo(enemy - enemies, nx, ny);
+
+    if (enemy->chasingSteps > 0)
+        enemy->chasingSteps--;
+}
+
+_Thread_local int lastHitBy = -1; // EnemyType that last hurt the player, for the death statistics
+
+void processCombat(Player *player, Enemy *enemy, int weaponDamage)
+{
+    enemy->damageThreshold -= weaponDamage;
+
+    if (enemy->damageThreshold <= 0)
+    {
+        displayMessage("You have defeated the enemy!");
+        enemy->isActive = 0;
+        removeEnemyFromMap(enemy - enemies);
+    }
+    else
+    {
+        int enemyAttackDamage = 2; // You can vary this per enemy type
+        player->health -= enemyAttackDamage;
+        lastHitBy = enemy->type;
+        char msg[100];
+        sprintf(msg, "The enemy attacked you for %d damage!", enemyAttackDamage);
+        displayMessage(msg);
+    }
+}
+
+int isEnemyInRoom(Enemy *enemy, Room room)
+{
+    return (enemy->x >= room.x && enemy->x <= (room.x + room.width) &&
+            enemy->y >= room.y && enemy->y <= (room.y + room.height));
+}
+
+int getEnemyIndexAt(int x, int y)
+{
+    if (x < 0 || x >= MAP_WIDTH || y < 0 || y >= MAP_HEIGHT)
+        return -1;
+    return enemyAt[y][x];
+}
+
+void damageEnemy(int eIndex, int damage, int canStun)
+{
+    Enemy *enemy = &enemies[eIndex];
+    enemy->damageThreshold -= damage + playerDamageBonus;
+    if (enemy->damageThreshold <= 0)
+    {
+        // Its pending event (if any) is dropped when it pops
+        enemy->isActive = 0;
+        removeEnemyFromMap(eIndex);
+        setMessage("You have defeated the enemy!");
+        return;
+    }
+    if (canStun)
+        enemy->stunnedUntil = currentTurn + STUN_DURATION;
+}
+
+int isqrt(long n)
+{
+    int r = 0;
+    while ((long)(r + 1) * (r + 1) <= n)
+        r++;
+    return r;
+}
+
+// Catch a room up on everything that happened while the player was away.
+// Instead of replaying each missed turn, the elapsed time is applied in one
+// coarse step: a random walk of n steps drifts about sqrt(n) cells, wounds
+// heal at a fixed rate and an emptied room is restocked after a while.
+// Only sleeping enemies are caught up; awake ones are in the turn queue.
+void fastForwardRoom(Room *room, Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    long elapsed = currentTurn - room->lastSimulatedTurn;
+    room->lastSimulatedTurn = currentTurn;
+    if (elapsed <= 0)
+        return;
+
+    int minX = room->x + 1, maxX = room->x + room->width - 2;
+    int minY = room->y + 1, maxY = room->y + room->height - 2;
+    int drift = isqrt(elapsed);
+    int alive = 0;
+
+    for (int i = 0; i < enemyCount; i++)
+    {
+        Enemy *enemy = &enemies[i];
+        if (enemy->damageThreshold <= 0 || !isEnemyInRoom(enemy, *room))
+            continue;
+        alive++;
+        // Awake ones have been playing their turns all along
+        if (enemy->isActive || enemy->scheduled)
+            continue;
+
+        // Wandering
+        int nx = enemy->x + (drift ? randomInt() % (2 * drift + 1) - drift : 0);
+        int ny = enemy->y + (drift ? randomInt() % (2 * drift + 1) - drift : 0);
+        nx = nx < minX ? minX : (nx > maxX ? maxX : nx);
+        ny = ny < minY ? minY : (ny > maxY ? maxY : ny);
+        if (map[ny][nx] == TILE_FLOOR && getEnemyIndexAt(nx, ny) == -1 &&
+            !(nx == playerX && ny == playerY))
+        {
+            moveEnemyTo(i, nx, ny);
+        }
+
+        // Regeneration
+        long healed = enemy->damageThreshold + elapsed / ENEMY_REGEN_INTERVAL;
+        enemy->damageThreshold = healed > enemy->maxDamageThreshold ? enemy->maxDamageThreshold : (int)healed;
+    }
+
+    // Respawn
+    if (alive == 0 && elapsed >= ENEMY_RESPAWN_TURNS)
+        placeEnemiesInRoom(*room, enemies, &enemyCount);
+}
+
+// Put every sleeping enemy that can see the player back into the turn
+// queue. Awake ones are not asked: they check for themselves when they act.
+// Sleepers do not move, so nothing changes for them until the player does
+// (or the level does, see forgetSight), and only those within fovRadius
+// can see the player at all.
+void noticePlayer(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    int player = playerY * MAP_WIDTH + playerX;
+    if (player == noticedPlayerCell)
+        return;
+    noticedPlayerCell = player;
+    for (int i = 0; i < enemyCount; i++)
+    {
+        Enemy *enemy = &enemies[i];
+        if (enemy->damageThreshold <= 0 || enemy->scheduled)
+            continue;
+        int dx = enemy->x - playerX, dy = enemy->y - playerY;
+        if (dx * dx + dy * dy > fovRadius * fovRadius + fovRadius || !playerInSight(map, enemy->x, enemy->y))
+            continue;
+        if (scheduleEvent(currentTurn + 1, EV_ENEMY_ACT, i))
+        {
+            enemy->isActive = 1;
+            enemy->scheduled = true;
+        }
+    }
+}
+
+void handleEnemyAct(Player *player, int eIndex, Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    Enemy *enemy = &enemies[eIndex];
+    enemy->scheduled = false;
+
+    if (enemy->damageThreshold <= 0)
+        return; // dead enemies simply leave the queue
+
+    // The player is out of sight: the enemy falls asleep and is not polled
+    // any more
+    if (!playerInSight(map, enemy->x, enemy->y))
+    {
+        enemy->isActive = 0;
+        return;
+    }
+
+    if (enemy->stunnedUntil > currentTurn)
+    {
+        enemy->scheduled = scheduleEvent(enemy->stunnedUntil, EV_ENEMY_ACT, eIndex);
+        return;
+    }
+
+    moveEnemyTowardsPlayer(enemy, playerX, playerY, map);
+    if (enemy->x == playerX && enemy->y == playerY)
+        processCombat(player, enemy, weaponInventory[0].damage); // Use the first weapon's damage
+
+    if (enemy->isActive)
+        enemy->scheduled = scheduleEvent(currentTurn + enemy->actionDelay, EV_ENEMY_ACT, eIndex);
+}
+
+// Advance the world by one turn and fire every event that became due
+void advanceTurn(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    currentTurn++;
+
+    ScheduledEvent ev;
+    while (popDueEvent(currentTurn, &ev))
+    {
+        switch (ev.type)
+        {
+        case EV_ENEMY_ACT:
+            handleEnemyAct(player, ev.target, map);
+            break;
+        case EV_HUNGER_TICK:
+            if (player->hunger < HUNGER_STARVING)
+                player->hunger++;
+            else
+                player->health--; // az goshnegi salamat kam mishavad
+            // Cannot fail: the tick just left its reserved slot
+            scheduleEvent(currentTurn + HUNGER_TICK_INTERVAL, EV_HUNGER_TICK, 0);
+            break;
+        case EV_FOOD_EFFECT_END:
+            playerDamageBonus -= ev.target;
+            break;
+        }
+    }
+    noticePlayer(map);
+}
+
+void initializePlayerInventory()
+{
+    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    {
+        playerInventory[i].type = i;
+        playerInventory[i].quantity = 0;
+    }
+    playerInventory[WT_MACE].quantity = 1;
+    currentWeaponType = WT_MACE;
+}
+
+Weapon *getWeaponDef(WeaponType wtype)
+{
+    return &allWeaponTypes[wtype];
+}
+
+void placeWeaponsOnMap(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    {
+        if (i == WT_MACE)
+            continue;
+        int tries = 100;
+        while (tries--)
+        {
+            int x = randomInt() % (MAP_WIDTH - 2) + 1;
+            int y = randomInt() % (MAP_HEIGHT - 2) + 1;
+            if (map[y][x] == TILE_FLOOR)
+            {
+                placeWeapon(x, y, i);
+                break;
+            }
+        }
+    }
+}
+
+// Leave one unit of the equipped weapon on the floor under the player
+void dropCurrentWeapon()
+{
+    Weapon *wpn = getWeaponDef(currentWeaponType);
+    if (currentWeaponType == WT_MACE || playerInventory[currentWeaponType].quantity <= 0)
+    {
+        setMessage("Nothing to drop.");
+        return;
+    }
+    if (!dropItem(playerX, playerY, ITEM_WEAPON, currentWeaponType, 1))
+        return;
+    playerInventory[currentWeaponType].quantity--;
+    setMessage("Dropped a %s.", wpn->name);
+    if (playerInventory[currentWeaponType].quantity == 0)
+        currentWeaponType = WT_MACE;
+}
+
+void displayInventory()
+{
+    Surface *win = openOverlay(MAX_WEAPON_TYPES + 12, 76);
+    surfPrint(win, 1, 2, "======= Inventory =======");
+    surfPrint(win, 3, 2, "Melee Weapons:");
+    int line = 4;
+    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    {
+        if (allWeaponTypes[i].category == WEAPON_CATEGORY_MELEE)
+        {
+            surfPrint(win, line++, 2, "  %c) %s [Qty:%d, Dmg:%d]", allWeaponTypes[i].icon, allWeaponTypes[i].name, playerInventory[i].quantity, allWeaponTypes[i].damage);
+        }
+    }
+    line++;
+    surfPrint(win, line++, 2, "Ranged Weapons:");
+    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    {
+        if (allWeaponTypes[i].category == WEAPON_CATEGORY_RANGED)
+        {
+            surfPrint(win, line++, 2, "  %c) %s [Qty:%d, Range:%d, Dmg:%d]", allWeaponTypes[i].icon, allWeaponTypes[i].name, playerInventory[i].quantity, allWeaponTypes[i].maxDistance, allWeaponTypes[i].damage);
+        }
+    }
+    line++;
+    surfPrint(win, line++, 2, "Press the character of the weapon to equip it, or ESC to cancel.");
+    surfPrint(win, line++, 2, "If you already have a weapon equipped, press 'w' first to store it.");
+    int ch = overlayGetch(win);
+    closeOverlay(win);
+    if (ch == 27)
+    {
+        return;
+    }
+    char weaponChar = (char)ch;
+    int found = -1;
+    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    {
+        if (weaponChar == allWeaponTypes[i].icon)
+        {
+            found = i;
+            break;
+        }
+    }
+    if (found == -1)
+    {
+        setMessage("That weapon does not exist.");
+        return;
+    }
+    if (playerInventory[found].quantity <= 0 && !allWeaponTypes[found].permanent && found != WT_MACE)
+    {
+        setMessage("No quantity left.");
+        return;
+    }
+    if (currentWeaponType != WT_MACE && (int)currentWeaponType != found)
+    {
+        setMessage("Please return your currently equipped weapon first.");
+        return;
+    }
+    currentWeaponType = found;
+    setMessage("Equipped weapon: %s", allWeaponTypes[currentWeaponType].name);
+}
+
+void storeCurrentWeapon()
+{
+    if (currentWeaponType != WT_MACE)
+    {
+        currentWeaponType = WT_MACE;
+        setMessage("Stored current weapon. Mace re-equipped.");
+    }
+    else
+    {
+        setMessage("Mace was already equipped. Nothing to store.");
+    }
+}
+
+void performMeleeAttack()
+{
+    Weapon *wpn = getWeaponDef(currentWeaponType);
+    for (int dy = -1; dy <= 1; dy++)
+    {
+        for (int dx = -1; dx <= 1; dx++)
+        {
+            if (dx == 0 && dy == 0)
+                continue;
+            int nx = playerX + dx;
+            int ny = playerY + dy;
+            int eIndex = getEnemyIndexAt(nx, ny);
+            if (eIndex != -1)
+            {
+                damageEnemy(eIndex, wpn->damage, wpn->canStun);
+            }
+        }
+    }
+}
+
+// Direction of a shot from an arrow key or a diagonal key (y u b n)
+bool shotDirection(int key, int *dx, int *dy)
+{
+    *dx = 0;
+    *dy = 0;
+    switch (key)
+    {
+    case KEY_UP:
+        *dy = -1;
+        break;
+    case KEY_DOWN:
+        *dy = 1;
+        break;
+    case KEY_LEFT:
+        *dx = -1;
+        break;
+    case KEY_RIGHT:
+        *dx = 1;
+        break;
+    case 'y':
+        *dx = -1;
+        *dy = -1;
+        break;
+    case 'u':
+        *dx = 1;
+        *dy = -1;
+        break;
+    case 'b':
+        *dx = -1;
+        *dy = 1;
+        break;
+    case 'n':
+        *dx = 1;
+        *dy = 1;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+// Nearest awake enemy within the given range, or -1
+int nearestEnemyInRange(int range)
+{
+    int best = -1, bestDist = range + 1;
+    for (int i = 0; i < enemyCount; i++)
+    {
+        if (!enemies[i].isActive || enemies[i].damageThreshold <= 0)
+            continue;
+        int ax = abs(enemies[i].x - playerX), ay = abs(enemies[i].y - playerY);
+        int dist = ax > ay ? ax : ay;
+        // One standing on the player would give the projectile no direction
+        if (dist > 0 && dist < bestDist)
+        {
+            best = i;
+            bestDist = dist;
+        }
+    }
+    return best;
+}
+
+bool projectilesInFlight()
+{
+    for (int i = 0; i < MAX_PROJECTILES; i++)
+        if (projectiles[i].active)
+            return true;
+    return false;
+}
+
+bool launchProjectile(WeaponType weapon, int targetX, int targetY)
+{
+    for (int i = 0; i < MAX_PROJECTILES; i++)
+    {
+        Projectile *p = &projectiles[i];
+        if (p->active)
+            continue;
+        p->active = true;
+        p->weapon = weapon;
+        p->x = playerX;
+        p->y = playerY;
+        p->dx = abs(targetX - playerX);
+        p->dy = -abs(targetY - playerY);
+        p->sx = playerX < targetX ? 1 : -1;
+        p->sy = playerY < targetY ? 1 : -1;
+        p->err = p->dx + p->dy;
+        p->travelled = 0;
+        p->maxDistance = allWeaponTypes[weapon].maxDistance;
+        return true;
+    }
+    return false;
+}
+
+// Thrown weapons land where the flight ended; the rest (wand bolts) just vanish
+void dropAmmo(Tile map[MAP_HEIGHT][MAP_WIDTH], Projectile *p)
+{
+    if (allWeaponTypes[p->weapon].recoverable && TILE_HAS(map[p->y][p->x], TF_WALKABLE))
+        dropItem(p->x, p->y, ITEM_WEAPON, p->weapon, 1);
+}
+
+// One Bresenham step of a projectile; the line keeps going past the target
+// point until the weapon's range is used up
+void stepProjectile(Tile map[MAP_HEIGHT][MAP_WIDTH], Projectile *p)
+{
+    int nx = p->x, ny = p->y;
+    int e2 = 2 * p->err;
+    if (e2 >= p->dy)
+    {
+        p->err += p->dy;
+        nx += p->sx;
+    }
+    if (e2 <= p->dx)
+    {
+        p->err += p->dx;
+        ny += p->sy;
+    }
+
+    if (nx < 0 || nx >= MAP_WIDTH || ny < 0 || ny >= MAP_HEIGHT)
+    {
+        setMessage("Projectile flew out of bounds and is lost!");
+        p->active = false;
+        return;
+    }
+    if (TILE_HAS(map[ny][nx], TF_BLOCKS_PROJECTILE))
+    {
+        setMessage("%s hit a wall and fell to the ground.", allWeaponTypes[p->weapon].name);
+        dropAmmo(map, p);
+        p->active = false;
+        return;
+    }
+
+    p->x = nx;
+    p->y = ny;
+    p->travelled++;
+
+    int eIndex = getEnemyIndexAt(nx, ny);
+    if (eIndex != -1)
+    {
+        Weapon *wpn = getWeaponDef(p->weapon);
+        setMessage("%s hit the enemy!", wpn->name);
+        damageEnemy(eIndex, wpn->damage, wpn->canStun);
+        p->active = false;
+        return;
+    }
+    if (p->travelled >= p->maxDistance)
+    {
+        dropAmmo(map, p);
+        p->active = false;
+    }
+}
+
+// Advance every projectile by the frames that passed since the last call,
+// so flight speed does not depend on how fast keys are pressed
+void updateProjectiles(Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    static _Thread_local long lastFrame = 0;
+    long now = nowMs();
+    if (!projectilesInFlight())
+    {
+        lastFrame = now;
+        return;
+    }
+    int frames = (int)((now - lastFrame) / PROJECTILE_FRAME_MS);
+    if (headless)
+        frames = 1; // one step per frame, so recorded frames do not depend on timing
+    if (frames <= 0)
+        return;
+    lastFrame = now;
+
+    for (int f = 0; f < frames; f++)
+        for (int i = 0; i < MAX_PROJECTILES; i++)
+            if (projectiles[i].active)
+                stepProjectile(map, &projectiles[i]);
+}
+
+void performRangedAttack(int direction, Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    if (direction < 0)
+        return;
+    Weapon *wpn = getWeaponDef(currentWeaponType);
+    if (playerInventory[currentWeaponType].quantity <= 0 && !wpn->permanent)
+    {
+        setMessage("No ammo left for %s!", wpn->name);
+        return;
+    }
+
+    int targetX, targetY, dx, dy;
+    if (direction == 't')
+    {
+        int eIndex = nearestEnemyInRange(wpn->maxDistance);
+        if (eIndex == -1)
+        {
+            setMessage("No enemy in range.");
+            return;
+        }
+        targetX = enemies[eIndex].x;
+        targetY = enemies[eIndex].y;
+    }
+    else if (shotDirection(direction, &dx, &dy))
+    {
+        targetX = playerX + dx * wpn->maxDistance;
+        targetY = playerY + dy * wpn->maxDistance;
+    }
+    else
+    {
+        return;
+    }
+
+    if (!launchProjectile(currentWeaponType, targetX, targetY))
+        return;
+    updateProjectiles(map); // restarts the frame clock if nothing was flying
+    if (!wpn->permanent)
+    {
+        playerInventory[currentWeaponType].quantity--;
+        if (playerInventory[currentWeaponType].quantity < 0)
+            playerInventory[currentWeaponType].quantity = 0;
+    }
+}
+
+void playerAttack(int repeat, Tile map[MAP_HEIGHT][MAP_WIDTH])
+{
+    Weapon *wpn = getWeaponDef(currentWeaponType);
+    if (wpn->category == WEAPON_CATEGORY_MELEE)
+    {
+        performMeleeAttack();
+        return;
+    }
+    else
+    {
+        if (repeat && lastShotDirection != -1)
+        {
+            performRangedAttack(lastShotDirection, map);
+            return;
+        }
+        showMessageNow("Press an arrow key or y/u/b/n to shoot, t to target the nearest enemy.", 0);
+        int dir = readKey(mapWin);
+        lastShotDirection = dir;
+        performRangedAttack(dir, map);
+    }
+}
+
+//----------------------------------------------------------------------------
+// MAIN
+//----------------------------------------------------------------------------
+// Everything one key does for the player, short of passing the turn
+void handlePlayerKey(int ch, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[], int room_count)
+{
+    int newX = playerX;
+    int newY = playerY;
+
+    if (ch == KEY_UP)
+        newY--;
+    else if (ch == KEY_DOWN)
+        newY++;
+    else if (ch == KEY_LEFT)
+        newX--;
+    else if (ch == KEY_RIGHT)
+        newX++;
+    else if (ch == 'E' || ch == 'e')
+    {
+        showFoodMenu(player);
+        // pardazesh entekhab va be-rozresani salamat/goshnegi
+    }
+    else if (ch == 'i')
+    {
+        displayInventory();
+    }
+    else if (ch == 'w')
+    {
+        storeCurrentWeapon();
+    }
+    else if (ch == 'd')
+    {
+        dropCurrentWeapon();
+    }
+    else if (ch == ' ')
+    {
+        playerAttack(0, map);
+    }
+    else if (ch == 'a')
+    {
+        playerAttack(1, map);
+    }
+
+    // Check if the new position is walkable
+    if (isWalkable(map, newX, newY))
+    {
+        playerX = newX;
+        playerY = newY;
+        player->x = playerX;
+        player->y = playerY;
+
+        pickUpItemsAt(player, playerX, playerY);
+        lookAt(playerX, playerY);
+
+        // Update visited status for rooms
+        int rIndex = roomIndexAt(room_count, rooms, playerX, playerY);
+        if (rIndex != -1)
+            rooms[rIndex].visited = true;
+
+        // Redraw dungeon with updated visibility
+    }
+    int rIndex = roomIndexAt(room_count, rooms, playerX, playerY); // Declare rIndex here
+    if (rIndex != playerRoomIndex)
+    {
+        // Stamp the room we leave, fast-forward the one we enter
+        if (playerRoomIndex != -1)
+            rooms[playerRoomIndex].lastSimulatedTurn = currentTurn;
+        playerRoomIndex = rIndex;
+        if (rIndex != -1)
+            fastForwardRoom(&rooms[rIndex], map);
+    }
+
+    // Stepping onto an enemy starts a fight right away
+    int eIndex = getEnemyIndexAt(playerX, playerY);
+    if (eIndex != -1 && enemies[eIndex].isActive)
+        processCombat(player, &enemies[eIndex], weaponInventory[0].damage);
+}
+
+//----------------------------------------------------------------------------
+// REAL-TIME MODE
+//----------------------------------------------------------------------------
+// With --realtime the world advances on a fixed clock instead of on every
+// key: one turn per tick, whether the player pressed anything or not.
+// Movement keys that arrive between ticks are coalesced (the last direction
+// wins) and applied on the next tick; other commands run at once and pause
+// the clock while their menu is open. Drawing is not tied to the tick:
+// projectiles still animate at their own frame rate.
+#define TICK_MS 100 // 10 turns per second
+
+_Thread_local long tickCount = 0, ticksLate = 0;
+_Thread_local long tickUsTotal = 0, tickUsMax = 0; // simulation time, without rendering
+
+bool isMoveKey(int ch)
+{
+    return ch == KEY_UP || ch == KEY_DOWN || ch == KEY_LEFT || ch == KEY_RIGHT;
+}
+
+// Forward declarations: stairs are taken in FLOORS, the window moves in OVERWORLD
+bool useStairs(int ch, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS], int *room_count);
+void followPlayerInWorld(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS], int *room_count);
+
+// Checked after every step of the real-time loop, which then leaves to the
+// final score just like the turn loop in main
+bool playerDied(Player *player)
+{
+    if (player->health > 0)
+        return false;
+    setMessage("shoma mordid!");
+    return true;
+}
+
+void runRealTime(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+                 Room rooms[], int *room_count)
+{
+    long nextTick = nowMs() + TICK_MS;
+    int pendingMove = ERR;
+    tickBudgetUs = TICK_MS * 1000L;
+    while (1)
+    {
+        long wait = nextTick - nowMs();
+        if (projectilesInFlight() && wait > PROJECTILE_FRAME_MS)
+            wait = PROJECTILE_FRAME_MS;
+        setInputTimeout(wait > 0 ? (int)wait : 0);
+
+        int ch = readKey(NULL);
+        if (ch == 'q')
+            break;
+        bool redraw = false;
+        if (isMoveKey(ch))
+            pendingMove = ch;
+        else if (ch != ERR)
+        {
+            setInputTimeout(-1); // menus and prompts wait for their key
+            messageLine[0] = '\0';
+            if (ch == '>' || ch == '<')
+                useStairs(ch, player, map, rooms, room_count);
+            else
+                handlePlayerKey(ch, player, map, rooms, *room_count);
+            if (playerDied(player))
+                break;
+            nextTick = nowMs() + TICK_MS; // the clock stood still meanwhile
+            redraw = true;
+        }
+
+        if (nowMs() >= nextTick)
+        {
+            long start = nowUs();
+            if (pendingMove != ERR)
+            {
+                messageLine[0] = '\0';
+                handlePlayerKey(pendingMove, player, map, rooms, *room_count);
+                pendingMove = ERR;
+            }
+            advanceTurn(player, map);
+            long spent = nowUs() - start;
+            tickLastUs = spent;
+            tickUsTotal += spent;
+            if (spent > tickUsMax)
+                tickUsMax = spent;
+            tickCount++;
+
+            // Never try to catch up on missed ticks, just note them
+            nextTick += TICK_MS;
+            if (nowMs() >= nextTick)
+            {
+                ticksLate++;
+                nextTick = nowMs() + TICK_MS;
+            }
+            if (playerDied(player))
+                break;
+            redraw = true;
+        }
+
+        if (projectilesInFlight())
+        {
+            updateProjectiles(map);
+            if (playerDied(player))
+                break;
+            redraw = true;
+        }
+        if (redraw)
+        {
+            followPlayerInWorld(player, map, rooms, room_count);
+            printDungeon(map, visible, player);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// INPUT BATCHING
+//----------------------------------------------------------------------------
+// A held arrow key fills the input queue faster than frames can be drawn.
+// Moves that are already waiting are played as turns back to back and only
+// the last one is drawn, unless something happens the player should see
+// first: a message (combat), a pickup, damage, or an enemy coming into view.
+bool turnInterrupted(Player *player, int healthBefore, int enemiesBefore,
+                     CellSet *visible)
+{
+    return messageLine[0] != '\0' || player->health < healthBefore ||
+           projectilesInFlight() || countVisibleEnemies(visible) > enemiesBefore;
+}
+
+// One undrawn move as a full turn; false when it should be the last one
+bool autoStep(int key, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+              Room rooms[], int room_count)
+{
+    int healthBefore = player->health;
+    int enemiesBefore = countVisibleEnemies(visible);
+    int collectedBefore = itemsCollected;
+    handlePlayerKey(key, player, map, rooms, room_count);
+    advanceTurn(player, map);
+    refreshVisibility(map, visible);
+    return itemsCollected == collectedBefore &&
+           !turnInterrupted(player, healthBefore, enemiesBefore, visible);
+}
+
+// Play the moves that are already queued behind the current one
+void drainQueuedMoves(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+                      Room rooms[], int room_count, int healthBefore, int enemiesBefore)
+{
+    refreshVisibility(map, visible);
+    if (turnInterrupted(player, healthBefore, enemiesBefore, visible))
+        return;
+    while (true)
+    {
+        int ch = pollKey();
+        if (ch == ERR)
+            return;
+        if (!isMoveKey(ch))
+        {
+            pushedBackKey = ch; // menus and attacks go through the normal path
+            return;
+        }
+        if (!autoStep(ch, player, map, visible, rooms, room_count))
+            return;
+    }
+}
+
+//----------------------------------------------------------------------------
+// RUN AND TRAVEL
+//----------------------------------------------------------------------------
+// Shift+arrow runs in one direction; 'g' travels to a chosen cell along a
+// shortest path over explored ground. Both play their steps as turns with
+// no frame in between and stop as soon as autoStep reports something worth
+// seeing. Paths between two doors are asked for again and again (room to
+// room), so those are kept in a small per-level cache. A cached path is the
+// shortest over what was explored when it was found; it is dropped as soon
+// as a cell explored later could make it shorter (see forgetPathsNear).
+#define MAX_PATH_STEPS (MAP_WIDTH * MAP_HEIGHT)
+#define PATH_CACHE_SIZE 32
+
+typedef struct
+{
+    int from, to; // cells, row * MAP_WIDTH + col; -1 when unused
+    int length;
+    unsigned char *steps; // direction keys as indexes into stepKeys
+} CachedPath;
+
+_Thread_local CachedPath pathCache[PATH_CACHE_SIZE];
+_Thread_local int pathCacheNext = 0; // oldest entry, replaced first
+_Thread_local long pathCacheHits = 0, pathSearches = 0;
+
+static const int stepDX[4] = {0, 0, -1, 1};
+static const int stepDY[4] = {-1, 1, 0, 0};
+static const int stepKeys[4] = {KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT};
+
+void forgetCachedPath(CachedPath *entry)
+{
+    free(entry->steps);
+    entry->steps = NULL;
+    entry->from = entry->to = -1;
+}
+
+// A cell explored after a path was cached can only shorten it if going
+// through that cell could still be shorter than the path is
+void forgetPathsNear(int x, int y)
+{
+    for (int i = 0; i < PATH_CACHE_SIZE; i++)
+    {
+        CachedPath *entry = &pathCache[i];
+        if (entry->from != -1 &&
+            abs(x - entry->from % MAP_WIDTH) + abs(y - entry->from / MAP_WIDTH) +
+                    abs(x - entry->to % MAP_WIDTH) + abs(y - entry->to / MAP_WIDTH) <
+                entry->length)
+            forgetCachedPath(entry);
+    }
+}
+
+// Forget all paths, e.g. when a new level is generated
+void clearPathCache()
+{
+    for (int i = 0; i < PATH_CACHE_SIZE; i++)
+        forgetCachedPath(&pathCache[i]);
+    pathCacheNext = 0;
+}
+
+_Thread_local bool travelThroughUnknown = false; // set while heading for a room not seen yet
+
+bool canTravelOn(Tile map[MAP_HEIGHT][MAP_WIDTH], int x, int y)
+{
+    return isWalkable(map, x, y) && (hasCell(&explored, x, y) || travelThroughUnknown);
+}
+
+// Breadth-first search from (x0, y0). Stops at the first cell for which
+// isGoal() holds (or at goalCell when isGoal is NULL) and writes the step
+// directions there into steps. Returns the number of steps, or -1. Paths
+// that go into the cache must not depend on where monsters stand right now,
+// so walking around them is optional.
+int findPath(Tile map[MAP_HEIGHT][MAP_WIDTH], int x0, int y0, int goalCell,
+             bool (*isGoal)(int x, int y), bool avoidEnemies,
+             unsigned char *steps, int *reached)
+{
+    static _Thread_local int cameFrom[MAP_HEIGHT * MAP_WIDTH]; // direction index, or -1 if not seen
+    static _Thread_local int queue[MAP_HEIGHT * MAP_WIDTH];
+    for (int i = 0; i < MAP_HEIGHT * MAP_WIDTH; i++)
+        cameFrom[i] = -1;
+    pathSearches++;
+
+    int head = 0, tail = 0, start = y0 * MAP_WIDTH + x0, found = -1;
+    queue[tail++] = start;
+    cameFrom[start] = 4;
+    while (head < tail)
+    {
+        int cell = queue[head++];
+        int x = cell % MAP_WIDTH, y = cell / MAP_WIDTH;
+        if (cell != start && (isGoal ? isGoal(x, y) : cell == goalCell))
+        {
+            found = cell;
+            break;
+        }
+        for (int d = 0; d < 4; d++)
+        {
+            int nx = x + stepDX[d], ny = y + stepDY[d];
+            if (!canTravelOn(map, nx, ny) || cameFrom[ny * MAP_WIDTH + nx] != -1)
+                continue;
+            if (avoidEnemies && enemyAt[ny][nx] != -1)
+                continue;
+            cameFrom[ny * MAP_WIDTH + nx] = d;
+            queue[tail++] = ny * MAP_WIDTH + nx;
+        }
+    }
+    if (found == -1)
+        return -1;
+
+    // Walk back to the start, then reverse
+    int length = 0;
+    for (int cell = found; cell != start; length++)
+    {
+        int d = cameFrom[cell];
+        steps[length] = d;
+        cell -= stepDY[d] * MAP_WIDTH + stepDX[d];
+    }
+    for (int i = 0; i < length / 2; i++)
+    {
+        unsigned char t = steps[i];
+        steps[i] = steps[length - 1 - i];
+        steps[length - 1 - i] = t;
+    }
+    if (reached)
+        *reached = found;
+    return length;
+}
+
+// Door to door paths come from the cache when they can
+int doorPath(Tile map[MAP_HEIGHT][MAP_WIDTH], int from, int to, unsigned char *steps)
+{
+    for (int i = 0; i < PATH_CACHE_SIZE; i++)
+    {
+        if (pathCache[i].from == from && pathCache[i].to == to)
+        {
+            pathCacheHits++;
+            memcpy(steps, pathCache[i].steps, pathCache[i].length);
+            return pathCache[i].length;
+        }
+    }
+    int length = findPath(map, from % MAP_WIDTH, from / MAP_WIDTH, to, NULL, false, steps, NULL);
+    // A way through unexplored cells is only good for this trip
+    if (length > 0 && !travelThroughUnknown)
+    {
+        CachedPath *entry = &pathCache[pathCacheNext];
+        pathCacheNext = (pathCacheNext + 1) % PATH_CACHE_SIZE;
+        free(entry->steps);
+        entry->steps = malloc(length);
+        memcpy(entry->steps, steps, length);
+        entry->from = from;
+        entry->to = to;
+        entry->length = length;
+    }
+    return length;
+}
+
+bool isKnownGold(int x, int y)
+{
+    for (int id = itemAt[y][x]; id != -1; id = itemPool[id].next)
+        if (itemPool[id].kind == ITEM_GOLD || itemPool[id].kind == ITEM_BLACK_GOLD)
+            return true;
+    return false;
+}
+
+bool isKnownDoor(int x, int y)
+{
+    return doorIndexAt[y][x] != -1;
+}
+
+bool isKnownDownStairs(int x, int y)
+{
+    return y * MAP_WIDTH + x == stairsDownCell;
+}
+
+bool isKnownUpStairs(int x, int y)
+{
+    return y * MAP_WIDTH + x == stairsUpCell;
+}
+
+void followPath(unsigned char *steps, int length, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH],
+                CellSet *visible, Room rooms[], int room_count)
+{
+    for (int i = 0; i < length; i++)
+    {
+        int nx = playerX + stepDX[steps[i]], ny = playerY + stepDY[steps[i]];
+        if (getEnemyIndexAt(nx, ny) != -1)
+        {
+            setMessage("Something is in the way.");
+            return;
+        }
+        if (!autoStep(stepKeys[steps[i]], player, map, visible, rooms, room_count))
+            return;
+    }
+}
+
+int runDirection(int key)
+{
+    switch (key)
+    {
+    case KEY_SR:
+        return 0;
+    case KEY_SF:
+        return 1;
+    case KEY_SLEFT:
+        return 2;
+    case KEY_SRIGHT:
+        return 3;
+    }
+    return -1;
+}
+
+// Shift+arrow: keep going until something blocks the way, a door is
+// reached, or something interrupts
+void runPlayer(int d, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+               Room rooms[], int room_count)
+{
+    while (true)
+    {
+        int nx = playerX + stepDX[d], ny = playerY + stepDY[d];
+        if (!isWalkable(map, nx, ny) || getEnemyIndexAt(nx, ny) != -1)
+            return;
+        if (!autoStep(stepKeys[d], player, map, visible, rooms, room_count))
+            return;
+        if (TILE_HAS(map[playerY][playerX], TF_DOOR))
+            return;
+    }
+}
+
+// Move a cursor over the map with the arrows and pick a cell with Enter.
+// Returns the cell, or -1 when cancelled.
+int pickCell(int x, int y)
+{
+    while (true)
+    {
+        chtype under = 0;
+        if (inViewport(x, y))
+        {
+            under = surfGet(mapWin, y - camY, x - camX);
+            surfPut(mapWin, y - camY, x - camX, 'X' | A_REVERSE);
+        }
+        showMessageNow("Travel to: move with arrows, Enter to go, ESC to cancel", 0);
+        int ch = readKey(mapWin);
+        if (inViewport(x, y))
+            surfPut(mapWin, y - camY, x - camX, under);
+
+        if (ch == '\n' || ch == '\r' || ch == KEY_ENTER || ch == '.')
+            return y * MAP_WIDTH + x;
+        int d = -1;
+        for (int i = 0; i < 4; i++)
+            if (ch == stepKeys[i])
+                d = i;
+        if (d == -1)
+            return -1;
+        int nx = x + stepDX[d], ny = y + stepDY[d];
+        if (nx >= 0 && nx < MAP_WIDTH && ny >= 0 && ny < MAP_HEIGHT)
+        {
+            x = nx;
+            y = ny;
+            // Keep the cursor on screen
+            int oldX = playerX, oldY = playerY;
+            playerX = x;
+            playerY = y;
+            moveCamera();
+            playerX = oldX;
+            playerY = oldY;
+        }
+    }
+}
+
+//----------------------------------------------------------------------------
+// AUTO-EXPLORE
+//----------------------------------------------------------------------------
+// 'o' keeps walking to the nearest frontier cell: explored and walkable,
+// with an unexplored neighbour. Whenever more has been explored, the
+// frontier is worked out again for the rows that changed and the rows next
+// to them, as word operations on the cell sets: the unexplored cells are
+// spread one step in each direction and masked with the explored walkable
+// ones. The search stops at the first frontier cell it reaches. Like any
+// batch of moves, exploring stops after a turn that picked something up.
+#define AUTO_EXPLORE_MIN_HEALTH 30
+
+_Thread_local CellSet frontier;
+_Thread_local int frontierCount = 0;
+
+void updateFrontier(void)
+{
+    uint64_t stale[STALE_ROW_WORDS], any = 0;
+    for (int w = 0; w < STALE_ROW_WORDS; w++)
+        any |= stale[w] = frontierStaleRows[w];
+    if (!any)
+        return;
+    memset(frontierStaleRows, 0, sizeof(frontierStaleRows));
+
+    // Rows past the map's edge are unexplored in the overworld and nothing
+    // otherwise
+    uint64_t edge = overworld ? ~UINT64_C(0) : 0;
+    for (int y = 0; y < MAP_HEIGHT; y++)
+    {
+        // A cell's frontier bit looks at its own row and the two next to it
+        if (!gridBit(stale, STALE_ROW_WORDS, y, 0)
+            && !(y > 0 && gridBit(stale, STALE_ROW_WORDS, y - 1, 0))
+            && !(y + 1 < MAP_HEIGHT && gridBit(stale, STALE_ROW_WORDS, y + 1, 0)))
+            continue;
+        uint64_t row[ROW_WORDS];
+        for (int w = 0; w < ROW_WORDS; w++)
+            row[w] = ~explored.rows[y][w] & rowWordMask(w);
+        for (int w = 0; w < ROW_WORDS; w++)
+        {
+            // Bit x of west is cell x - 1, of east cell x + 1
+            uint64_t west = row[w] << 1 | (w > 0 ? row[w - 1] >> 63 : edge & 1);
+            uint64_t east = row[w] >> 1 | (w + 1 < ROW_WORDS ? row[w + 1] << 63 : 0);
+            if (w == ROW_WORDS - 1)
+                east |= (edge & 1) << ((MAP_WIDTH - 1) % 64);
+            uint64_t north = y > 0 ? ~explored.rows[y - 1][w] : edge;
+            uint64_t south = y + 1 < MAP_HEIGHT ? ~explored.rows[y + 1][w] : edge;
+            uint64_t open = west | east | ((north | south) & rowWordMask(w));
+            frontierCount -= __builtin_popcountll(frontier.rows[y][w]);
+            frontier.rows[y][w] = explored.rows[y][w] & walkableCells.rows[y][w] & open;
+            frontierCount += __builtin_popcountll(frontier.rows[y][w]);
+        }
+    }
+}
+
+bool isFrontier(int x, int y)
+{
+    return hasCell(&frontier, x, y);
+}
+
+void autoExplore(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+                 Room rooms[], int room_count)
+{
+    static _Thread_local unsigned char steps[MAX_PATH_STEPS];
+    while (true)
+    {
+        refreshVisibility(map, visible);
+        updateFrontier();
+        // Enemies coming into view stop autoStep; one already next to us does too
+        for (int i = 0; i < enemyCount; i++)
+        {
+            if (enemies[i].isActive && abs(enemies[i].x - playerX) <= 1 && abs(enemies[i].y - playerY) <= 1)
+            {
+                setMessage("Not with an enemy next to you.");
+                return;
+            }
+        }
+        if (player->health < AUTO_EXPLORE_MIN_HEALTH)
+        {
+            setMessage("Too hurt to explore.");
+            return;
+        }
+        if (frontierCount == 0)
+        {
+            setMessage("Nothing left to explore.");
+            return;
+        }
+        int target;
+        int length = findPath(map, playerX, playerY, -1, isFrontier, true, steps, &target);
+        if (length <= 0)
+        {
+            setMessage("Nothing left to explore that can be reached.");
+            return;
+        }
+
+        // Walk until the target stops being frontier, then look again
+        for (int i = 0; i < length && hasCell(&frontier, target % MAP_WIDTH, target / MAP_WIDTH); i++)
+        {
+            if (!autoStep(stepKeys[steps[i]], player, map, visible, rooms, room_count))
+                return;
+            updateFrontier();
+        }
+    }
+}
+
+bool doorSeen(int door)
+{
+    return hasCell(&explored, doors[door].cell % MAP_WIDTH, doors[door].cell / MAP_WIDTH);
+}
+
+#define LEG_ARRIVED 0
+#define LEG_NO_PATH 1
+#define LEG_STOPPED 2 // something interrupted the walk
+
+// One leg of a trip, short enough to search tile by tile
+int travelLeg(int target, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+               Room rooms[], int room_count)
+{
+    static _Thread_local unsigned char steps[MAX_PATH_STEPS];
+    int here = playerY * MAP_WIDTH + playerX;
+    if (here == target)
+        return LEG_ARRIVED;
+    int length;
+    if (doorIndexAt[playerY][playerX] != -1 && doorIndexAt[target / MAP_WIDTH][target % MAP_WIDTH] != -1)
+        length = doorPath(map, here, target, steps);
+    else
+        length = findPath(map, playerX, playerY, target, NULL, true, steps, NULL);
+    if (length <= 0)
+        return LEG_NO_PATH;
+    followPath(steps, length, player, map, visible, rooms, room_count);
+    return playerY * MAP_WIDTH + playerX == target ? LEG_ARRIVED : LEG_STOPPED;
+}
+
+// Walk the door route that ends in door last (see doorDistances)
+int travelRoute(int last, int previous[MAX_DOORS], Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH],
+                CellSet *visible, Room rooms[], int room_count)
+{
+    int route[MAX_DOORS], length = 0;
+    for (int door = last; door != -1; door = previous[door])
+        route[length++] = door;
+    while (length > 0)
+    {
+        int result = travelLeg(doors[route[--length]].cell, player, map, visible, rooms, room_count);
+        if (result != LEG_ARRIVED)
+            return result;
+    }
+    return LEG_ARRIVED;
+}
+
+// Anywhere on the level: plan over the door graph, walk it leg by leg
+void travelTo(int target, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+              Room rooms[], int room_count)
+{
+    int tx = target % MAP_WIDTH, ty = target / MAP_WIDTH;
+    int room = cellRoom[playerY][playerX];
+    if (room == -1 || room != cellRoom[ty][tx])
+    {
+        static _Thread_local DoorCosts start, end;
+        int cost[MAX_DOORS], previous[MAX_DOORS];
+        doorsAround(map, playerX, playerY, &start);
+        doorsAround(map, tx, ty, &end);
+        doorDistances(&start, doorSeen, cost, previous);
+
+        int last = -1;
+        for (int i = 0; i < doorCount; i++)
+            if (cost[i] != -1 && end.cost[i] != -1 &&
+                (last == -1 || cost[i] + end.cost[i] < cost[last] + end.cost[last]))
+                last = i;
+        // When a leg is not known yet, a plain search may still find a way
+        if (last != -1 && travelRoute(last, previous, player, map, visible, rooms, room_count) == LEG_STOPPED)
+            return;
+    }
+    if (travelLeg(target, player, map, visible, rooms, room_count) == LEG_NO_PATH)
+        setMessage("No known way there.");
+}
+
+// The closest door into a room not yet visited, going on from seen doors only:
+// the corridors leading off them may be followed into the unknown
+int nearestUnvisitedRoomDoor(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[], int previous[MAX_DOORS])
+{
+    static _Thread_local DoorCosts start;
+    int cost[MAX_DOORS];
+    doorsAround(map, playerX, playerY, &start);
+    doorDistances(&start, doorSeen, cost, previous);
+    int best = -1;
+    for (int i = 0; i < doorCount; i++)
+        if (cost[i] != -1 && doors[i].room != -1 && !rooms[doors[i].room].visited &&
+            (best == -1 || cost[i] < cost[best]))
+            best = i;
+    return best;
+}
+
+// The room not yet visited that is fewest corridor cells away over the room
+// graph, leaving each room by a door already seen; viaLink[room] is the link
+// it is entered by. -1 when there is none, e.g. on classic levels, whose
+// links do not know their doors.
+int nearestUnvisitedRoom(Room rooms[], int from, int viaLink[MAX_ROOMS])
+{
+    int cost[MAX_ROOMS];
+    bool done[MAX_ROOMS] = {false};
+    for (int i = 0; i < MAX_ROOMS; i++)
+        cost[i] = viaLink[i] = -1;
+    cost[from] = 0;
+    while (true)
+    {
+        int room = -1;
+        for (int i = 0; i < MAX_ROOMS; i++)
+            if (!done[i] && cost[i] != -1 && (room == -1 || cost[i] < cost[room]))
+                room = i;
+        if (room == -1 || !rooms[room].visited)
+            return room;
+        done[room] = true;
+        for (int n = 0; n < roomNeighbourCount[room]; n++)
+        {
+            int link = roomNeighbours[room][n];
+            int door = roomLinks[link].a == room ? roomLinks[link].doorA : roomLinks[link].doorB;
+            if (door == -1 || !hasCell(&explored, door % MAP_WIDTH, door / MAP_WIDTH))
+                continue;
+            int next = linkedRoom(link, room);
+            if (cost[next] == -1 || cost[room] + roomLinks[link].length < cost[next])
+            {
+                cost[next] = cost[room] + roomLinks[link].length;
+                viaLink[next] = link;
+            }
+        }
+    }
+}
+
+// Walk from room to room along the links that lead to target, door to door
+int travelRoomRoute(int from, int target, int viaLink[MAX_ROOMS], Player *player,
+                    Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible, Room rooms[], int room_count)
+{
+    int route[MAX_ROOMS], length = 0;
+    for (int room = target; room != from; room = linkedRoom(viaLink[room], room))
+        route[length++] = viaLink[room];
+    for (int room = from; length > 0;)
+    {
+        RoomLink *link = &roomLinks[route[--length]];
+        bool forward = link->a == room;
+        int result = travelLeg(forward ? link->doorA : link->doorB, player, map, visible, rooms, room_count);
+        if (result == LEG_ARRIVED)
+            result = travelLeg(forward ? link->doorB : link->doorA, player, map, visible, rooms, room_count);
+        if (result != LEG_ARRIVED)
+            return result;
+        room = forward ? link->b : link->a;
+    }
+    return LEG_ARRIVED;
+}
+
+// 'g': '$' nearest known gold, '+' nearest door, '>' or '<' the stairs,
+// 'r' nearest room not yet visited, or any cell picked on screen
+void travelPrompt(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], CellSet *visible,
+                  Room rooms[], int room_count)
+{
+    static _Thread_local unsigned char steps[MAX_PATH_STEPS];
+    showMessageNow("Travel to: $ gold, + door, > < stairs, r new room, Enter to pick a spot", 0);
+    int ch = readKey(mapWin);
+    int length = -1, here = playerY * MAP_WIDTH + playerX;
+    messageLine[0] = '\0';
+
+    if (ch == '$')
+        length = findPath(map, playerX, playerY, -1, isKnownGold, true, steps, NULL);
+    else if (ch == '>')
+        length = findPath(map, playerX, playerY, -1, isKnownDownStairs, true, steps, NULL);
+    else if (ch == '<')
+        length = findPath(map, playerX, playerY, -1, isKnownUpStairs, true, steps, NULL);
+    else if (ch == '+')
+    {
+        int door;
+        length = findPath(map, playerX, playerY, -1, isKnownDoor, true, steps, &door);
+        // Standing in a doorway: the next door is usually the one across the
+        // room, the pair this cache is for
+        if (length > 0 && isKnownDoor(playerX, playerY))
+            length = doorPath(map, here, door, steps);
+    }
+    else if (ch == 'r')
+    {
+        // From inside a room the room graph knows where each seen door
+        // leads; elsewhere, or when it has no way, the door graph is asked
+        int viaLink[MAX_ROOMS], previous[MAX_DOORS];
+        int room = cellRoom[playerY][playerX];
+        int target = room == -1 ? -1 : nearestUnvisitedRoom(rooms, room, viaLink);
+        int door = target == -1 ? nearestUnvisitedRoomDoor(map, rooms, previous) : -1;
+        if (target == -1 && door == -1)
+            setMessage("No unvisited room that you know a way to.");
+        else
+        {
+            travelThroughUnknown = true;
+            if (target != -1)
+            {
+                if (travelRoomRoute(room, target, viaLink, player, map, visible, rooms, room_count) == LEG_NO_PATH)
+                    setMessage("No known way there.");
+            }
+            else
+                travelRoute(door, previous, player, map, visible, rooms, room_count);
+            travelThroughUnknown = false;
+        }
+        return;
+    }
+    else if (ch == '\n' || ch == '\r' || ch == KEY_ENTER)
+    {
+        int target = pickCell(playerX, playerY);
+        messageLine[0] = '\0';
+        if (target != -1 && target != here)
+            travelTo(target, player, map, visible, rooms, room_count);
+        return;
+    }
+    else
+        return;
+
+    if (length <= 0)
+    {
+        setMessage("No known way there.");
+        return;
+    }
+    followPath(steps, length, player, map, visible, rooms, room_count);
+}
+
+//----------------------------------------------------------------------------
+// BOTS
+//----------------------------------------------------------------------------
+// A bot plays through the same keys a person would: readKey() asks it for
+// the next key instead of the terminal, so moves, playerAttack(), the food
+// menu and the inventory run exactly as in a normal game. A bot's plan()
+// looks at the game and queues the keys of its next command, menu answers
+// included. Bots run headless with drawing switched off.
+#define BOT_MAX_KEYS 8
+#define BOT_STALL_LIMIT 50 // plans without a turn passing before giving up
+
+typedef struct
+{
+    Player *player;
+    Tile (*map)[MAP_WIDTH];
+    CellSet *visible;
+} BotView;
+
+typedef struct
+{
+    const char *name;
+    void (*plan)(BotView *view, int keys[BOT_MAX_KEYS], int *count);
+} BotPlayer;
+
+BotPlayer *activeBot = NULL;
+_Thread_local BotView botView;
+_Thread_local int botKeys[BOT_MAX_KEYS];
+_Thread_local int botKeyCount = 0, botKeyNext = 0;
+long botMaxTurns = 5000;
+_Thread_local long botLastTurn = -1;
+_Thread_local int botStalls = 0;
+_Thread_local long botDeadlineUs = 0; // 0: none; past it the game is stopped (see SIMULATION)
+_Thread_local bool botTimedOut = false;
+
+bool enemyNextToPlayer()
+{
+    for (int i = 0; i < enemyCount; i++)
+        if (enemies[i].isActive && abs(enemies[i].x - playerX) <= 1 && abs(enemies[i].y - playerY) <= 1)
+            return true;
+    return false;
+}
+
+// Collect gold, fight what comes close, eat when hurt, carry the best blade,
+// and go down the stairs once the floor has nothing more to give.
+void greedyPlan(BotView *view, int keys[BOT_MAX_KEYS], int *count)
+{
+    static _Thread_local unsigned char steps[MAX_PATH_STEPS];
+    Player *player = view->player;
+    *count = 0;
+
+    if (player->health < 50 && foodCount > 0)
+    {
+        keys[(*count)++] = 'e';
+        keys[(*count)++] = '1';
+        return;
+    }
+    // Monsters can share our cell (both start in the middle of the first
+    // room) where melee cannot reach them: step aside first
+    if (getEnemyIndexAt(playerX, playerY) != -1)
+    {
+        for (int d = 0; d < 4; d++)
+        {
+            int nx = playerX + stepDX[d], ny = playerY + stepDY[d];
+            if (isWalkable(view->map, nx, ny) && getEnemyIndexAt(nx, ny) == -1)
+            {
+                keys[(*count)++] = stepKeys[d];
+                return;
+            }
+        }
+    }
+    if (enemyNextToPlayer())
+    {
+        keys[(*count)++] = ' ';
+        if (allWeaponTypes[currentWeaponType].category == WEAPON_CATEGORY_RANGED)
+            keys[(*count)++] = 't';
+        return;
+    }
+    int best = WT_MACE;
+    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+        if (allWeaponTypes[i].category == WEAPON_CATEGORY_MELEE && playerInventory[i].quantity > 0 &&
+            allWeaponTypes[i].damage > allWeaponTypes[best].damage)
+            best = i;
+    if (best != (int)currentWeaponType)
+    {
+        if (currentWeaponType != WT_MACE)
+            keys[(*count)++] = 'w';
+        keys[(*count)++] = 'i';
+        keys[(*count)++] = allWeaponTypes[best].icon;
+        return;
+    }
+    if (findPath(view->map, playerX, playerY, -1, isKnownGold, true, steps, NULL) > 0)
+    {
+        keys[(*count)++] = 'g';
+        keys[(*count)++] = '$';
+        return;
+    }
+    updateFrontier();
+    if (findPath(view->map, playerX, playerY, -1, isFrontier, true, steps, NULL) > 0)
+    {
+        keys[(*count)++] = 'o';
+        return;
+    }
+    if (view->map[playerY][playerX] == TILE_STAIRS_DOWN)
+    {
+        keys[(*count)++] = '>';
+        return;
+    }
+    if (findPath(view->map, playerX, playerY, -1, isKnownDownStairs, true, steps, NULL) > 0)
+    {
+        keys[(*count)++] = 'g';
+        keys[(*count)++] = '>';
+        return;
+    }
+    // Nothing left to do but meet the monsters that are still around
+    for (int i = 0; i < enemyCount; i++)
+    {
+        if (!enemies[i].isActive || !hasCell(view->visible, enemies[i].x, enemies[i].y))
+            continue;
+        keys[(*count)++] = abs(enemies[i].x - playerX) > abs(enemies[i].y - playerY)
+                               ? (enemies[i].x > playerX ? KEY_RIGHT : KEY_LEFT)
+                               : (enemies[i].y > playerY ? KEY_DOWN : KEY_UP);
+        return;
+    }
+    keys[(*count)++] = 'q';
+}
+
+BotPlayer allBots[] = {
+    {"greedy", greedyPlan},
+};
+
+BotPlayer *findBot(const char *name)
+{
+    for (int i = 0; i < (int)(sizeof(allBots) / sizeof(allBots[0])); i++)
+        if (strcmp(allBots[i].name, name) == 0)
+            return &allBots[i];
+    return NULL;
+}
+
+int botKey()
+{
+    if (botKeyNext < botKeyCount)
+        return botKeys[botKeyNext++];
+
+    // A new command: stop at the turn limit, or when the bot goes nowhere
+    if (currentTurn >= botMaxTurns)
+        return 'q';
+    if (botDeadlineUs && nowUs() > botDeadlineUs)
+    {
+        botTimedOut = true;
+        return 'q';
+    }
+    if (currentTurn == botLastTurn)
+    {
+        if (++botStalls >= BOT_STALL_LIMIT)
+            return 'q';
+        if (botStalls % 5 == 0)
+            return stepKeys[randomInt() % 4]; // shake it loose
+    }
+    else
+        botStalls = 0;
+    botLastTurn = currentTurn;
+
+    activeBot->plan(&botView, botKeys, &botKeyCount);
+    botKeyNext = 0;
+    return botKeyCount > 0 ? botKeys[botKeyNext++] : 'q';
+}
+
+//----------------------------------------------------------------------------
+// LEVEL BUILDING
+//----------------------------------------------------------------------------
+#define MAX_FLOORS 26 // the last one has no stairs down
+
+// A random floor cell of the room, away from its centre where the monster
+// and (on the first floor) the player start
+void placeInRoom(Tile map[MAP_HEIGHT][MAP_WIDTH], Room *room, Tile tile)
+{
+    for (int tries = 0; tries < 100; tries++)
+    {
+        int x = room->x + 1 + randomInt() % (room->width - 2);
+        int y = room->y + 1 + randomInt() % (room->height - 2);
+        if (map[y][x] == TILE_FLOOR && (x != room->centerX || y != room->centerY))
+        {
+            map[y][x] = tile;
+            return;
+        }
+    }
+    map[room->centerY][room->centerX] = tile;
+}
+
+// Down in the last room, up in the first one, where the player arrives
+void placeStairs(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[], int room_count, int depth)
+{
+    int last = room_count - 1;
+    while (last > 0 && !rooms[last].created)
+        last--;
+    if (depth < MAX_FLOORS)
+        placeInRoom(map, &rooms[last], TILE_STAIRS_DOWN);
+    if (depth > 1)
+        placeInRoom(map, &rooms[0], TILE_STAIRS_UP);
+}
+
+// Terrain, stairs, items and monsters of the floor at depth, all from the
+// current randomInt() state. Returns the number of rooms in use; *generated
+// (if given) gets the number generate_rooms() actually made.
+int buildLevel(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS], int depth, int *generated)
+{
+    clearEnemyOccupancy();
+    enemyCount = 0;
+    initItems();
+    clearPathCache();
+    clearRoomGraph();
+    init_map(map);
+
+    int room_count;
+    if (levelGenerator == GEN_BSP)
+    {
+        room_count = generateBspLevel(rooms, MAX_ROOMS, map);
+        if (generated)
+            *generated = room_count;
     }
     else
     {
-        int enemyAttackDamage = 2; // You can vary this per enemy type
-        player->health -= enemyAttackDamage;
-        char msg[100];
-        sprintf(msg, "The enemy attacked you for %d damage!", enemyAttackDamage);
-        displayMessage(msg);
+        // Reserve memory for our rooms and create them
+        room_count = generate_rooms(rooms, MAX_ROOMS);
+        if (generated)
+            *generated = room_count;
+
+        // Ensure we generate at least MIN_ROOMS for a decent dungeon
+        if (room_count < MIN_ROOMS)
+            room_count = MIN_ROOMS;
+
+        // Draw each room
+        for (int i = 0; i < room_count; i++)
+        {
+            draw_room(map, rooms[i]);
+        }
+
+        // Connect rooms with corridors (the doors are wherever the corridor
+        // happens to cross a wall, so the graph does not know them)
+        for (int i = 1; i < room_count; i++)
+        {
+            int prev_centerX = rooms[i - 1].centerX;
+            int prev_centerY = rooms[i - 1].centerY;
+            int curr_centerX = rooms[i].centerX;
+            int curr_centerY = rooms[i].centerY;
+            draw_corridor(map, prev_centerX, prev_centerY, curr_centerX, curr_centerY);
+            addRoomLink(i - 1, i, -1, -1, abs(curr_centerX - prev_centerX) + abs(curr_centerY - prev_centerY));
+        }
+    }
+    buildDoorGraph(map, rooms, room_count);
+    placeStairs(map, rooms, room_count, depth);
+    buildCellIndexes(map);
+
+    placeRegularGold(map);
+    placeBlackGold(map);
+    placeFood(map);
+    placeWeapons(map);
+
+    for (int i = 0; i < room_count; i++)
+    {
+        placeEnemiesInRoom(rooms[i], enemies, &enemyCount);
+    }
+    placeWeaponsOnMap(map);
+    return room_count;
+}
+
+//----------------------------------------------------------------------------
+// FLOOR CODEC
+//----------------------------------------------------------------------------
+// A floor the player is not on is kept as one string of bytes. The map is
+// run-length coded together with the explored bits: it is mostly long runs
+// of unexplored rock and of floor, so it shrinks to a few hundred bytes.
+// Rooms, links, items and monsters follow as variable-length numbers (7
+// bits a byte), which for the small values they hold is one byte each.
+// Items go in cell order, every cell's stack from the top, and each gives
+// its cell as the distance from the item before.
+#define RUN_SHORT 7                  // runs up to this long fit in the tile byte
+#define RUN_LONG (RUN_SHORT + 256)   // longer ones take a second byte
+#define NUMBER_MAX_BYTES 10
+
+_Static_assert(TILE_COUNT <= 16, "a run byte has four bits for the tile");
+
+typedef struct
+{
+    size_t size;
+    unsigned char data[];
+} PackedFloor;
+
+void putNumber(unsigned char **out, unsigned long value)
+{
+    while (value >= 0x80)
+    {
+        *(*out)++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *(*out)++ = (unsigned char)value;
+}
+
+unsigned long getNumber(const unsigned char **in)
+{
+    unsigned long value = 0;
+    int shift = 0;
+    while (**in & 0x80)
+    {
+        value |= (unsigned long)(*(*in)++ & 0x7F) << shift;
+        shift += 7;
+    }
+    return value | (unsigned long)*(*in)++ << shift;
+}
+
+// -1 markers and dead monsters: zigzag, so small negatives stay short too
+void putSigned(unsigned char **out, long value)
+{
+    putNumber(out, value < 0 ? ~((unsigned long)value << 1) : (unsigned long)value << 1);
+}
+
+long getSigned(const unsigned char **in)
+{
+    unsigned long value = getNumber(in);
+    return value & 1 ? ~(long)(value >> 1) : (long)(value >> 1);
+}
+
+// One byte per run: tile in bits 0-3, explored in bit 4, length 1..7 in
+// bits 5-7. Length 0 there means the next byte holds the length.
+void putRun(unsigned char **out, int symbol, int length)
+{
+    while (length > 0)
+    {
+        int run = length < RUN_LONG ? length : RUN_LONG;
+        if (run <= RUN_SHORT)
+            *(*out)++ = (unsigned char)(symbol | run << 5);
+        else
+        {
+            *(*out)++ = (unsigned char)symbol;
+            *(*out)++ = (unsigned char)(run - RUN_SHORT - 1);
+        }
+        length -= run;
+    }
+}
+
+// A grid of tiles and their explored bits (rowWords words a row), as runs
+// of equal cells
+void putTiles(unsigned char **out, const Tile *tiles, const uint64_t *seen, int width, int height, int rowWords)
+{
+    int symbol = -1, length = 0;
+    for (int cell = 0; cell < width * height; cell++)
+    {
+        int next = tiles[cell] | gridBit(seen, rowWords, cell % width, cell / width) << 4;
+        if (next != symbol && length > 0)
+        {
+            putRun(out, symbol, length);
+            length = 0;
+        }
+        symbol = next;
+        length++;
+    }
+    putRun(out, symbol, length);
+}
+
+void getTiles(const unsigned char **in, Tile *tiles, uint64_t *seen, int width, int height, int rowWords)
+{
+    for (int cell = 0; cell < width * height;)
+    {
+        int symbol = **in & 0x1F, run = *(*in)++ >> 5;
+        if (run == 0)
+            run = RUN_SHORT + 1 + *(*in)++;
+        for (; run > 0; run--, cell++)
+        {
+            tiles[cell] = symbol & 0x0F;
+            setGridBit(seen, rowWords, cell % width, cell / width, symbol >> 4);
+        }
+    }
+}
+
+// Rooms and monsters are packed the same way on floors and overworld chunks
+void putRoom(unsigned char **out, Room *room)
+{
+    putSigned(out, room->x);
+    putSigned(out, room->y);
+    putNumber(out, room->width);
+    putNumber(out, room->height);
+    putSigned(out, room->centerX);
+    putSigned(out, room->centerY);
+    putNumber(out, room->created | room->visited << 1);
+    putNumber(out, room->lastSimulatedTurn);
+}
+
+void getRoom(const unsigned char **in, Room *room)
+{
+    room->x = (int)getSigned(in);
+    room->y = (int)getSigned(in);
+    room->width = (int)getNumber(in);
+    room->height = (int)getNumber(in);
+    room->centerX = (int)getSigned(in);
+    room->centerY = (int)getSigned(in);
+    int flags = (int)getNumber(in);
+    room->created = flags & 1;
+    room->visited = flags >> 1 & 1;
+    room->lastSimulatedTurn = (long)getNumber(in);
+}
+
+// Their turns are not packed with them: monsters come back asleep and wake
+// when they see the player again, as on the floor they were left on
+void putEnemy(unsigned char **out, Enemy *enemy)
+{
+    putSigned(out, enemy->x);
+    putSigned(out, enemy->y);
+    putNumber(out, enemy->type);
+    putSigned(out, enemy->damageThreshold);
+    putSigned(out, enemy->maxDamageThreshold);
+    putSigned(out, enemy->chasingSteps);
+    putNumber(out, enemy->actionDelay);
+    putSigned(out, enemy->stunnedUntil);
+}
+
+void getEnemy(const unsigned char **in, Enemy *enemy)
+{
+    enemy->x = (int)getSigned(in);
+    enemy->y = (int)getSigned(in);
+    enemy->type = (EnemyType)getNumber(in);
+    enemy->damageThreshold = (int)getSigned(in);
+    enemy->maxDamageThreshold = (int)getSigned(in);
+    enemy->chasingSteps = (int)getSigned(in);
+    enemy->actionDelay = (int)getNumber(in);
+    enemy->stunnedUntil = getSigned(in);
+    enemy->isActive = 0;
+    enemy->scheduled = false;
+}
+
+// Put an item at the bottom of a cell's stack, below what is there
+void stackItem(int x, int y, ItemKind kind, int subtype, int quantity)
+{
+    if (freeItemHead == -1)
+        return;
+    int id = freeItemHead;
+    freeItemHead = itemPool[id].next;
+    itemPool[id] = (Item){kind, subtype, quantity, -1};
+    int *link = &itemAt[y][x];
+    while (*link != -1)
+        link = &itemPool[*link].next;
+    *link = id;
+}
+
+// The floor in the calling thread's level state, packed
+PackedFloor *packFloor(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS], int room_count)
+{
+    size_t bound = NUMBER_MAX_BYTES * (3 + MAX_ROOMS * 8 + MAX_ROOM_LINKS * 5 + MAX_ITEMS * 3 + MAX_ENEMIES * 8) +
+                   MAP_HEIGHT * MAP_WIDTH;
+    PackedFloor *floor = malloc(sizeof(PackedFloor) + bound);
+    unsigned char *out = floor->data;
+
+    putNumber(&out, room_count);
+    for (int i = 0; i < room_count; i++)
+        putRoom(&out, &rooms[i]);
+    putNumber(&out, roomLinkCount);
+    for (int i = 0; i < roomLinkCount; i++)
+    {
+        RoomLink *link = &roomLinks[i];
+        putNumber(&out, link->a);
+        putNumber(&out, link->b);
+        putSigned(&out, link->doorA);
+        putSigned(&out, link->doorB);
+        putNumber(&out, link->length);
+    }
+
+    putTiles(&out, &map[0][0], &explored.rows[0][0], MAP_WIDTH, MAP_HEIGHT, ROW_WORDS);
+
+    int items = 0;
+    for (int cell = 0; cell < MAP_HEIGHT * MAP_WIDTH; cell++)
+        for (int id = itemAt[cell / MAP_WIDTH][cell % MAP_WIDTH]; id != -1; id = itemPool[id].next)
+            items++;
+    putNumber(&out, items);
+    int previous = 0;
+    for (int cell = 0; cell < MAP_HEIGHT * MAP_WIDTH; cell++)
+    {
+        for (int id = itemAt[cell / MAP_WIDTH][cell % MAP_WIDTH]; id != -1; id = itemPool[id].next)
+        {
+            putNumber(&out, cell - previous);
+            previous = cell;
+            putNumber(&out, itemPool[id].kind << 4 | itemPool[id].subtype);
+            putNumber(&out, itemPool[id].quantity);
+        }
+    }
+
+    putNumber(&out, enemyCount);
+    for (int i = 0; i < enemyCount; i++)
+        putEnemy(&out, &enemies[i]);
+
+    floor->size = out - floor->data;
+    return realloc(floor, sizeof(PackedFloor) + floor->size);
+}
+
+// Make a packed floor the current one (and free it). Returns its room count.
+int unpackFloor(PackedFloor *floor, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS])
+{
+    const unsigned char *in = floor->data;
+
+    int room_count = (int)getNumber(&in);
+    memset(rooms, 0, sizeof(Room) * MAX_ROOMS);
+    for (int i = 0; i < room_count; i++)
+        getRoom(&in, &rooms[i]);
+    clearRoomGraph();
+    int links = (int)getNumber(&in);
+    for (int i = 0; i < links; i++)
+    {
+        int a = (int)getNumber(&in);
+        int b = (int)getNumber(&in);
+        int doorA = (int)getSigned(&in);
+        int doorB = (int)getSigned(&in);
+        addRoomLink(a, b, doorA, doorB, (int)getNumber(&in));
+    }
+
+    getTiles(&in, &map[0][0], &explored.rows[0][0], MAP_WIDTH, MAP_HEIGHT, ROW_WORDS);
+
+    initItems();
+    int items = (int)getNumber(&in), cell = 0;
+    for (int i = 0; i < items; i++)
+    {
+        cell += (int)getNumber(&in);
+        int kind = (int)getNumber(&in);
+        stackItem(cell % MAP_WIDTH, cell / MAP_WIDTH, kind >> 4, kind & 0x0F, (int)getNumber(&in));
+    }
+
+    clearEnemyOccupancy();
+    enemyCount = (int)getNumber(&in);
+    for (int i = 0; i < enemyCount; i++)
+    {
+        getEnemy(&in, &enemies[i]);
+        if (enemies[i].damageThreshold > 0)
+            enemyAt[enemies[i].y][enemies[i].x] = i;
     }
+
+    buildDoorGraph(map, rooms, room_count);
+    buildCellIndexes(map);
+    clearPathCache();
+    free(floor);
+    return room_count;
 }
 
-int isEnemyInRoom(Enemy *enemy, Room room)
+//----------------------------------------------------------------------------
+// FLOOR CACHE
+//----------------------------------------------------------------------------
+// Packed floors stay in memory up to floorCacheBudget bytes (--floor-cache
+// KB). Past that, the floor used longest ago moves to a scratch file and is
+// read back from there when the player returns. Every floor keeps the place
+// it was first written to: it goes back there when it leaves memory again
+// and still fits, and only moves to the end of the file when it has grown,
+// so the file never holds more than one place per floor.
+#define FLOOR_CACHE_KB 64
+
+typedef struct
 {
-    return (enemy->x >= room.x && enemy->x <= (room.x + room.width) &&
-            enemy->y >= room.y && enemy->y <= (room.y + room.height));
+    PackedFloor *packed; // NULL while on disk, or not built yet
+    long spillAt;        // offset in spillFile
+    size_t spillSize;    // 0 when not on disk
+    size_t spillRoom;    // bytes this floor owns at spillAt, kept while in memory
+    long lastUsed;
+} CachedFloor;
+
+_Thread_local CachedFloor floorCache[MAX_FLOORS + 1]; // by depth; the current floor is not here
+_Thread_local size_t floorCacheBytes = 0;
+size_t floorCacheBudget = FLOOR_CACHE_KB * 1024;
+_Thread_local long floorCacheClock = 0;
+_Thread_local FILE *spillFile = NULL;
+_Thread_local long floorsSpilled = 0, floorsReadBack = 0;
+
+bool floorKnown(int depth)
+{
+    return floorCache[depth].packed || floorCache[depth].spillSize > 0;
+}
+
+// Move the floor used longest ago out to the scratch file
+bool spillOldestFloor()
+{
+    int oldest = -1;
+    for (int depth = 1; depth <= MAX_FLOORS; depth++)
+        if (floorCache[depth].packed && (oldest == -1 || floorCache[depth].lastUsed < floorCache[oldest].lastUsed))
+            oldest = depth;
+    if (oldest == -1 || (!spillFile && !(spillFile = tmpfile())))
+        return false;
+
+    CachedFloor *slot = &floorCache[oldest];
+    bool fits = slot->spillRoom >= slot->packed->size;
+    if (fits)
+        fseek(spillFile, slot->spillAt, SEEK_SET);
+    else
+        fseek(spillFile, 0, SEEK_END);
+    long at = ftell(spillFile);
+    if (fwrite(slot->packed->data, 1, slot->packed->size, spillFile) != slot->packed->size)
+        return false; // stays in memory, over the budget
+    slot->spillAt = at;
+    if (!fits)
+        slot->spillRoom = slot->packed->size;
+    slot->spillSize = slot->packed->size;
+    floorCacheBytes -= slot->spillSize;
+    free(slot->packed);
+    slot->packed = NULL;
+    floorsSpilled++;
+    return true;
+}
+
+void storeFloor(int depth, PackedFloor *packed)
+{
+    CachedFloor *slot = &floorCache[depth];
+    slot->packed = packed;
+    slot->spillSize = 0;
+    slot->lastUsed = ++floorCacheClock;
+    floorCacheBytes += packed->size;
+    while (floorCacheBytes > floorCacheBudget && spillOldestFloor())
+        ;
+}
+
+// Take the floor at depth out of the cache, from memory or from disk.
+// NULL if it was never stored (or the scratch file let us down).
+PackedFloor *fetchFloor(int depth)
+{
+    CachedFloor *slot = &floorCache[depth];
+    PackedFloor *packed = slot->packed;
+    if (packed)
+        floorCacheBytes -= packed->size;
+    else if (slot->spillSize > 0)
+    {
+        packed = malloc(sizeof(PackedFloor) + slot->spillSize);
+        packed->size = slot->spillSize;
+        fseek(spillFile, slot->spillAt, SEEK_SET);
+        if (fread(packed->data, 1, packed->size, spillFile) != packed->size)
+        {
+            free(packed);
+            packed = NULL;
+        }
+        floorsReadBack++;
+    }
+    slot->packed = NULL;
+    slot->spillSize = 0;
+    return packed;
 }
 
+//----------------------------------------------------------------------------
+// FLOORS
+//----------------------------------------------------------------------------
+// '>' on the stairs down goes one floor deeper, '<' on the stairs up goes
+// back. Every floor comes from its own seed, derived from the game's, so a
+// seed still names the whole dungeon. While the player is on floor N a
+// worker thread is already building floor N+1; taking the stairs only
+// joins it (it finished long ago) and unpacks the result. The floors the
+// player has left wait in the floor cache, so going back is as quick.
+_Thread_local int deepestFloor = 1;
+_Thread_local unsigned gameSeed = 0;
+_Thread_local long floorUnpacks = 0, floorUnpackUs = 0;
+
+// The worker gets everything it needs in its job: its own level state
+// starts empty, and so does its copy of the game's
 typedef struct
 {
-    WeaponType type;
-    int quantity;
-} PlayerWeaponEntry;
+    int depth;
+    unsigned seed;       // gameSeed of the game that wants the floor
+    PackedFloor *result; // set by the worker, read after the join
+} FloorJob;
 
-PlayerWeaponEntry playerInventory[MAX_WEAPON_TYPES];
-WeaponType currentWeaponType;
-int lastShotDirection = -1;
+_Thread_local pthread_t floorWorker;
+_Thread_local bool floorWorkerBusy = false;
+_Thread_local FloorJob floorJob;
 
-void initializePlayerInventory()
+unsigned floorSeed(unsigned seed, int depth)
 {
-    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    return depth == 1 ? seed : seed ^ (unsigned)depth * 2654435761u;
+}
+
+// Runs on the worker thread, in its own copy of the level state
+void *buildFloor(void *arg)
+{
+    FloorJob *job = arg;
+    Tile map[MAP_HEIGHT][MAP_WIDTH];
+    Room rooms[MAX_ROOMS] = {0};
+    seedRandom(floorSeed(job->seed, job->depth));
+    int room_count = buildLevel(map, rooms, job->depth, NULL);
+    job->result = packFloor(map, rooms, room_count);
+    return NULL;
+}
+
+void startFloorWorker(int depth)
+{
+    if (depth > MAX_FLOORS || floorKnown(depth) || floorWorkerBusy)
+        return;
+    floorJob = (FloorJob){depth, gameSeed, NULL};
+    if (pthread_create(&floorWorker, NULL, buildFloor, &floorJob) == 0)
+        floorWorkerBusy = true;
+}
+
+// Let a worker that is still building finish, e.g. when the game ends
+void joinFloorWorker()
+{
+    if (!floorWorkerBusy)
+        return;
+    pthread_join(floorWorker, NULL);
+    floorWorkerBusy = false;
+}
+
+// The packed floor at depth: kept from an earlier visit, or what the worker
+// built. Without a worker (it could not be started) it is built right here,
+// on the level state of the floor just packed away.
+PackedFloor *takeFloor(int depth)
+{
+    PackedFloor *floor = fetchFloor(depth);
+    if (floor)
+        return floor;
+    if (floorWorkerBusy)
     {
-        playerInventory[i].type = i;
-        playerInventory[i].quantity = 0;
+        joinFloorWorker();
+        PackedFloor *built = floorJob.result;
+        floorJob.result = NULL; // handed over or thrown away, either way no longer the job's
+        if (floorJob.depth == depth)
+            return built;
+        free(built);
     }
-    playerInventory[WT_MACE].quantity = 1;
-    currentWeaponType = WT_MACE;
+    unsigned long long gameRandom = randomState;
+    FloorJob job = {depth, gameSeed, NULL};
+    buildFloor(&job);
+    randomState = gameRandom;
+    return job.result;
 }
 
-Weapon *getWeaponDef(WeaponType wtype)
+// Start drawing the new floor from nothing: what of it was explored is
+// redrawn into the cleared pad and looked at again for the frontier
+void resetFloorView()
 {
-    return &allWeaponTypes[wtype];
+    memset(cellDirty, 0, sizeof(cellDirty));
+    dirtyCount = 0;
+    memset(frontierStaleRows, 0xff, sizeof(frontierStaleRows));
+    overlayCount = 0;
+    visX = visY = -1;
+    forgetSight();
+    surfErase(terrainPad);
+    surfErase(mapWin);
+    for (int cell = nextCell(&explored, 0); cell != -1; cell = nextCell(&explored, cell + 1))
+        markCellDirty(cell % MAP_WIDTH, cell / MAP_WIDTH);
 }
 
-void placeWeaponsOnMap()
+// Before the current level is packed away: stamp the player's room and
+// forget the monster turns and missiles that belong to it
+void leaveLevel(Room rooms[MAX_ROOMS])
 {
-    srand(time(NULL));
-    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    if (playerRoomIndex != -1)
+        rooms[playerRoomIndex].lastSimulatedTurn = currentTurn;
+    dropEvents(EV_ENEMY_ACT);
+    for (int i = 0; i < MAX_PROJECTILES; i++)
+        projectiles[i].active = false;
+}
+
+// The player stands at (playerX, playerY) of a level just put in place
+void arriveOnLevel(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS], int room_count)
+{
+    player->x = playerX;
+    player->y = playerY;
+    playerRoomIndex = roomIndexAt(room_count, rooms, playerX, playerY);
+    if (playerRoomIndex != -1)
     {
-        if (i == WT_MACE)
+        rooms[playerRoomIndex].visited = true;
+        fastForwardRoom(&rooms[playerRoomIndex], map);
+    }
+    resetFloorView();
+    noticePlayer(map);
+}
+
+void changeFloor(int depth, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS],
+                 int *room_count)
+{
+    bool down = depth > currentFloor;
+    leaveLevel(rooms);
+    storeFloor(currentFloor, packFloor(map, rooms, *room_count));
+    clearCells(&explored);
+
+    // A floor seen for the first time has nothing to catch up on
+    bool firstVisit = !floorKnown(depth);
+    PackedFloor *floor = takeFloor(depth);
+    long start = nowUs();
+    *room_count = unpackFloor(floor, map, rooms);
+    floorUnpackUs += nowUs() - start;
+    floorUnpacks++;
+    if (firstVisit)
+        for (int i = 0; i < MAX_ROOMS; i++)
+            rooms[i].lastSimulatedTurn = currentTurn;
+    currentFloor = depth;
+    if (depth > deepestFloor)
+        deepestFloor = depth;
+
+    // Arrive on the stairs that lead back
+    Tile arrival = down ? TILE_STAIRS_UP : TILE_STAIRS_DOWN;
+    for (int cell = 0; cell < MAP_HEIGHT * MAP_WIDTH; cell++)
+    {
+        if (map[cell / MAP_WIDTH][cell % MAP_WIDTH] == arrival)
+        {
+            playerX = cell % MAP_WIDTH;
+            playerY = cell / MAP_WIDTH;
+            break;
+        }
+    }
+    arriveOnLevel(player, map, rooms, *room_count);
+    startFloorWorker(depth + 1);
+    setMessage("You go %s to floor %d.", down ? "down" : "up", depth);
+}
+
+// '>' and '<' on the matching stairs. Returns true if the player moved.
+bool useStairs(int ch, Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS], int *room_count)
+{
+    if (map[playerY][playerX] != (ch == '>' ? TILE_STAIRS_DOWN : TILE_STAIRS_UP))
+    {
+        setMessage(ch == '>' ? "There are no stairs down here." : "There are no stairs up here.");
+        return false;
+    }
+    changeFloor(currentFloor + (ch == '>' ? 1 : -1), player, map, rooms, room_count);
+    return true;
+}
+
+//----------------------------------------------------------------------------
+// OVERWORLD
+//----------------------------------------------------------------------------
+// --overworld trades the floors for one world without end, made of square
+// chunks. A chunk is generated the first time it is needed, from the game
+// seed and its own position only, with the same rooms and corridors as the
+// levels. Rooms keep CHUNK_MARGIN away from the chunk border; corridors
+// cross it where both chunks agree without looking at each other: the
+// crossing on every border is worked out from the seed and the border's
+// position, so neighbours line up whichever is generated first.
+//
+// The game still plays on the MAP_WIDTH x MAP_HEIGHT map, which is now a
+// window onto the world. While the window covers them, a chunk's items and
+// monsters live on the map; when the player comes near the window's edge
+// they go back to their chunks and the window is put together again around
+// the player. At most RESIDENT_CHUNKS chunks are in memory; the one used
+// longest ago is written to its own file (--world-dir DIR, or a scratch
+// directory removed at the end) and read back from there when needed.
+#define CHUNK_SIZE 64
+#define CHUNK_ROW_WORDS ((CHUNK_SIZE + 63) / 64)
+#define CHUNK_MARGIN 2
+#define CHUNK_MAX_ROOMS 8
+#define CHUNK_MAX_ITEMS 128
+#define CHUNK_MAX_ENEMIES 16
+#define RESIDENT_CHUNKS 16
+#define WINDOW_EDGE_X 10 // the window moves when the player is this close to a side
+#define WINDOW_EDGE_Y 8
+
+_Static_assert(((MAP_WIDTH - 1) / CHUNK_SIZE + 2) * ((MAP_HEIGHT - 1) / CHUNK_SIZE + 2) <= RESIDENT_CHUNKS,
+               "the chunks under the window must fit in memory at once");
+
+typedef struct
+{
+    int cell;           // row * CHUNK_SIZE + col inside the chunk
+    int quantity;
+    unsigned char kind; // ItemKind
+    unsigned char subtype;
+} ChunkItem;
+
+typedef struct
+{
+    bool used;
+    int cx, cy;
+    long lastUsed;
+    Tile tiles[CHUNK_SIZE][CHUNK_SIZE];
+    uint64_t explored[CHUNK_SIZE][CHUNK_ROW_WORDS]; // as in CELL SETS
+    Room rooms[CHUNK_MAX_ROOMS]; // in world coordinates
+    int roomCount;
+    ChunkItem items[CHUNK_MAX_ITEMS]; // each cell's stack from the top
+    int itemCount;
+    Enemy enemies[CHUNK_MAX_ENEMIES]; // in world coordinates, all alive
+    int enemyCount;
+} Chunk;
+
+_Thread_local Chunk chunks[RESIDENT_CHUNKS];
+_Thread_local long chunkClock = 0;
+_Thread_local char worldDir[256] = "";
+_Thread_local bool worldDirIsScratch = false;
+_Thread_local long chunksGenerated = 0, chunksWritten = 0, chunksRead = 0;
+_Thread_local long windowMoves = 0, windowMoveUs = 0;
+
+#define SIDE_EAST 1
+#define SIDE_SOUTH 2
+
+// Rounds down, also for negative positions
+int floorDiv(int a, int b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+unsigned mixSeed(unsigned seed, int a, int b, int c)
+{
+    unsigned h = seed ^ 0x9E3779B9u;
+    h = (h ^ (unsigned)a) * 0x85EBCA6Bu;
+    h ^= h >> 13;
+    h = (h ^ (unsigned)b) * 0xC2B2AE35u;
+    h ^= h >> 16;
+    h = (h ^ (unsigned)c) * 0x85EBCA6Bu;
+    return h ^ h >> 13;
+}
+
+// The row where a corridor crosses the east border of chunk (cx, cy), or
+// the column where one crosses its south border
+int borderCrossing(int cx, int cy, int side)
+{
+    return CHUNK_MARGIN + (int)(mixSeed(gameSeed, cx, cy, side) % (CHUNK_SIZE - 2 * CHUNK_MARGIN));
+}
+
+bool chunkUnderWindow(Chunk *chunk)
+{
+    int left = chunk->cx * CHUNK_SIZE - worldLeft, top = chunk->cy * CHUNK_SIZE - worldTop;
+    return left < MAP_WIDTH && left + CHUNK_SIZE > 0 && top < MAP_HEIGHT && top + CHUNK_SIZE > 0;
+}
+
+// count items of one kind on floor cells of the chunk (weapons of any type)
+void scatterInChunk(Chunk *chunk, ItemKind kind, int subtype, int count)
+{
+    for (int tries = 0; count > 0 && tries < 1000 && chunk->itemCount < CHUNK_MAX_ITEMS; tries++)
+    {
+        int cell = randomInt() % (CHUNK_SIZE * CHUNK_SIZE);
+        if (chunk->tiles[cell / CHUNK_SIZE][cell % CHUNK_SIZE] != TILE_FLOOR)
             continue;
-        int tries = 100;
-        while (tries--)
+        int quantity = 1;
+        if (kind == ITEM_WEAPON)
+        {
+            subtype = randomInt() % MAX_WEAPON_TYPES;
+            quantity = allWeaponTypes[subtype].defaultQuantity;
+        }
+        else if (kind == ITEM_FOOD)
+            subtype = randomFoodType();
+        chunk->items[chunk->itemCount++] = (ChunkItem){cell, quantity, kind, subtype};
+        count--;
+    }
+}
+
+// Build a chunk from its seed, without touching the game's random numbers
+void generateChunk(Chunk *chunk)
+{
+    unsigned long long gameRandom = randomState;
+    seedRandom(mixSeed(gameSeed, chunk->cx, chunk->cy, 0));
+    Tile *cells = &chunk->tiles[0][0];
+    memset(chunk->tiles, TILE_ROCK, sizeof(chunk->tiles));
+    memset(chunk->explored, 0, sizeof(chunk->explored));
+    chunk->itemCount = chunk->enemyCount = 0;
+
+    Room *rooms = chunk->rooms;
+    int inner = CHUNK_SIZE - 2 * CHUNK_MARGIN;
+    chunk->roomCount = placeRooms(rooms, CHUNK_MAX_ROOMS, CHUNK_MARGIN, CHUNK_MARGIN, inner, inner);
+    for (int i = 0; i < chunk->roomCount; i++)
+        drawRoomOn(cells, CHUNK_SIZE, rooms[i]);
+    for (int i = 1; i < chunk->roomCount; i++)
+        drawCorridorOn(cells, CHUNK_SIZE, rooms[i - 1].centerX, rooms[i - 1].centerY, rooms[i].centerX,
+                       rooms[i].centerY);
+
+    // Every border crossing leads to the nearest room (in an empty chunk,
+    // they all meet in the middle)
+    int crossings[4][2] = {
+        {CHUNK_SIZE - 1, borderCrossing(chunk->cx, chunk->cy, SIDE_EAST)},
+        {0, borderCrossing(chunk->cx - 1, chunk->cy, SIDE_EAST)},
+        {borderCrossing(chunk->cx, chunk->cy, SIDE_SOUTH), CHUNK_SIZE - 1},
+        {borderCrossing(chunk->cx, chunk->cy - 1, SIDE_SOUTH), 0},
+    };
+    for (int side = 0; side < 4; side++)
+    {
+        int x = crossings[side][0], y = crossings[side][1];
+        int toX = CHUNK_SIZE / 2, toY = CHUNK_SIZE / 2, best = -1;
+        for (int i = 0; i < chunk->roomCount; i++)
         {
-            int x = rand() % (MAP_WIDTH - 2) + 1;
-            int y = rand() % (MAP_HEIGHT - 2) + 1;
-            if (map[y][x] == FLOOR)
+            int distance = abs(rooms[i].centerX - x) + abs(rooms[i].centerY - y);
+            if (best == -1 || distance < best)
             {
-                map[y][x] = allWeaponTypes[i].icon;
-                break;
+                best = distance;
+                toX = rooms[i].centerX;
+                toY = rooms[i].centerY;
             }
         }
+        // The leg that reaches the border must run straight into it
+        if (side < 2)
+            drawCorridorOn(cells, CHUNK_SIZE, x, y, toX, toY);
+        else
+            drawCorridorOn(cells, CHUNK_SIZE, toX, toY, x, y);
+    }
+
+    // As much loot as a level, and one monster a room
+    scatterInChunk(chunk, ITEM_GOLD, 0, 20);
+    scatterInChunk(chunk, ITEM_BLACK_GOLD, 0, 5);
+    scatterInChunk(chunk, ITEM_FOOD, 0, 10);
+    scatterInChunk(chunk, ITEM_WEAPON, 0, 5);
+    for (int i = 0; i < chunk->roomCount; i++)
+    {
+        Room *room = &rooms[i];
+        room->x += chunk->cx * CHUNK_SIZE;
+        room->y += chunk->cy * CHUNK_SIZE;
+        room->centerX += chunk->cx * CHUNK_SIZE;
+        room->centerY += chunk->cy * CHUNK_SIZE;
+        room->lastSimulatedTurn = currentTurn;
+        if (chunk->enemyCount < CHUNK_MAX_ENEMIES)
+            chunk->enemies[chunk->enemyCount++] =
+                makeEnemy((EnemyType)(randomInt() % ENEMY_TYPE_COUNT), room->centerX, room->centerY);
     }
+    chunksGenerated++;
+    randomState = gameRandom;
 }
 
-void collectWeaponAt(char map[MAP_HEIGHT][MAP_WIDTH], int x, int y)
+void chunkPath(char *path, size_t size, int cx, int cy)
 {
-    char cell = map[y][x];
-    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    snprintf(path, size, "%s/%d_%d", worldDir, cx, cy);
+}
+
+// Chunk files are packed like floors (see FLOOR CODEC)
+#define CHUNK_PACKED_MAX                                                                                          \
+    (NUMBER_MAX_BYTES * (3 + CHUNK_MAX_ROOMS * 8 + CHUNK_MAX_ITEMS * 3 + CHUNK_MAX_ENEMIES * 8) +              \
+     CHUNK_SIZE * CHUNK_SIZE * 2)
+
+bool writeChunk(Chunk *chunk)
+{
+    static _Thread_local unsigned char buffer[CHUNK_PACKED_MAX];
+    unsigned char *out = buffer;
+    putNumber(&out, chunk->roomCount);
+    for (int i = 0; i < chunk->roomCount; i++)
+        putRoom(&out, &chunk->rooms[i]);
+    putTiles(&out, &chunk->tiles[0][0], &chunk->explored[0][0], CHUNK_SIZE, CHUNK_SIZE, CHUNK_ROW_WORDS);
+    putNumber(&out, chunk->itemCount);
+    for (int i = 0; i < chunk->itemCount; i++)
+    {
+        ChunkItem *item = &chunk->items[i];
+        putNumber(&out, item->cell);
+        putNumber(&out, item->kind << 4 | item->subtype);
+        putNumber(&out, item->quantity);
+    }
+    putNumber(&out, chunk->enemyCount);
+    for (int i = 0; i < chunk->enemyCount; i++)
+        putEnemy(&out, &chunk->enemies[i]);
+
+    char path[sizeof(worldDir) + 32];
+    chunkPath(path, sizeof(path), chunk->cx, chunk->cy);
+    FILE *file = worldDir[0] ? fopen(path, "wb") : NULL;
+    if (!file)
+        return false;
+    size_t size = out - buffer;
+    bool written = fwrite(buffer, 1, size, file) == size;
+    if (fclose(file) != 0 || !written)
+        return false;
+    chunksWritten++;
+    return true;
+}
+
+// false if the chunk was never written (or cannot be read)
+bool readChunk(Chunk *chunk)
+{
+    static _Thread_local unsigned char buffer[CHUNK_PACKED_MAX];
+    char path[sizeof(worldDir) + 32];
+    chunkPath(path, sizeof(path), chunk->cx, chunk->cy);
+    FILE *file = worldDir[0] ? fopen(path, "rb") : NULL;
+    if (!file)
+        return false;
+    size_t size = fread(buffer, 1, sizeof(buffer), file);
+    fclose(file);
+    if (size == 0)
+        return false;
+
+    const unsigned char *in = buffer;
+    chunk->roomCount = (int)getNumber(&in);
+    for (int i = 0; i < chunk->roomCount; i++)
+        getRoom(&in, &chunk->rooms[i]);
+    getTiles(&in, &chunk->tiles[0][0], &chunk->explored[0][0], CHUNK_SIZE, CHUNK_SIZE, CHUNK_ROW_WORDS);
+    chunk->itemCount = (int)getNumber(&in);
+    for (int i = 0; i < chunk->itemCount; i++)
+    {
+        ChunkItem *item = &chunk->items[i];
+        item->cell = (int)getNumber(&in);
+        int kind = (int)getNumber(&in);
+        item->kind = kind >> 4;
+        item->subtype = kind & 0x0F;
+        item->quantity = (int)getNumber(&in);
+    }
+    chunk->enemyCount = (int)getNumber(&in);
+    for (int i = 0; i < chunk->enemyCount; i++)
+        getEnemy(&in, &chunk->enemies[i]);
+    chunksRead++;
+    return true;
+}
+
+// Chunk (cx, cy) in memory: already there, read back or generated. Makes
+// room by writing out the chunk used longest ago, never one under the window.
+Chunk *needChunk(int cx, int cy)
+{
+    Chunk *slot = NULL;
+    for (int i = 0; i < RESIDENT_CHUNKS; i++)
+    {
+        Chunk *chunk = &chunks[i];
+        if (chunk->used && chunk->cx == cx && chunk->cy == cy)
+        {
+            chunk->lastUsed = ++chunkClock;
+            return chunk;
+        }
+        if (!chunk->used)
+        {
+            if (!slot || slot->used)
+                slot = chunk;
+        }
+        else if ((!slot || (slot->used && chunk->lastUsed < slot->lastUsed)) && !chunkUnderWindow(chunk))
+            slot = chunk;
+    }
+    if (slot->used)
+        writeChunk(slot); // if this fails the chunk is generated anew next time
+    slot->used = true;
+    slot->cx = cx;
+    slot->cy = cy;
+    slot->lastUsed = ++chunkClock;
+    if (!readChunk(slot))
+        generateChunk(slot);
+    return slot;
+}
+
+typedef struct
+{
+    Room room;
+    int distance;
+} RoomChoice;
+
+int compareRoomChoices(const void *a, const void *b)
+{
+    return ((const RoomChoice *)a)->distance - ((const RoomChoice *)b)->distance;
+}
+
+// Put the level state together for the window at (worldLeft, worldTop):
+// terrain from the chunks under it, their items and monsters moved in, and
+// the rooms that lie wholly inside it, nearest to the player first.
+// Returns the room count.
+int composeWindow(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS])
+{
+    static _Thread_local RoomChoice choices[RESIDENT_CHUNKS * CHUNK_MAX_ROOMS];
+    int choiceCount = 0;
+    initItems();
+    clearEnemyOccupancy();
+    enemyCount = 0;
+
+    int firstCx = floorDiv(worldLeft, CHUNK_SIZE), lastCx = floorDiv(worldLeft + MAP_WIDTH - 1, CHUNK_SIZE);
+    int firstCy = floorDiv(worldTop, CHUNK_SIZE), lastCy = floorDiv(worldTop + MAP_HEIGHT - 1, CHUNK_SIZE);
+    for (int cy = firstCy; cy <= lastCy; cy++)
     {
-        if (cell == allWeaponTypes[i].icon)
+        for (int cx = firstCx; cx <= lastCx; cx++)
         {
-            if (allWeaponTypes[i].permanent)
+            Chunk *chunk = needChunk(cx, cy);
+            int left = cx * CHUNK_SIZE - worldLeft, top = cy * CHUNK_SIZE - worldTop; // chunk cell (0, 0) on the map
+            int fromX = left > 0 ? left : 0, toX = left + CHUNK_SIZE < MAP_WIDTH ? left + CHUNK_SIZE : MAP_WIDTH;
+            int fromY = top > 0 ? top : 0, toY = top + CHUNK_SIZE < MAP_HEIGHT ? top + CHUNK_SIZE : MAP_HEIGHT;
+            for (int y = fromY; y < toY; y++)
             {
-                playerInventory[i].quantity = 1;
+                memcpy(&map[y][fromX], &chunk->tiles[y - top][fromX - left], (toX - fromX) * sizeof(Tile));
+                for (int x = fromX; x < toX; x++)
+                    setGridBit(&explored.rows[0][0], ROW_WORDS, x, y,
+                               gridBit(&chunk->explored[0][0], CHUNK_ROW_WORDS, x - left, y - top));
             }
-            else
+
+            int kept = 0;
+            for (int i = 0; i < chunk->itemCount; i++)
             {
-                playerInventory[i].quantity += allWeaponTypes[i].defaultQuantity;
+                ChunkItem *item = &chunk->items[i];
+                int x = left + item->cell % CHUNK_SIZE, y = top + item->cell / CHUNK_SIZE;
+                if (x >= 0 && x < MAP_WIDTH && y >= 0 && y < MAP_HEIGHT && freeItemHead != -1)
+                    stackItem(x, y, item->kind, item->subtype, item->quantity);
+                else
+                    chunk->items[kept++] = *item;
+            }
+            chunk->itemCount = kept;
+
+            kept = 0;
+            for (int i = 0; i < chunk->enemyCount; i++)
+            {
+                Enemy enemy = chunk->enemies[i];
+                enemy.x -= worldLeft;
+                enemy.y -= worldTop;
+                if (enemy.x >= 0 && enemy.x < MAP_WIDTH && enemy.y >= 0 && enemy.y < MAP_HEIGHT &&
+                    enemyCount < MAX_ENEMIES && enemyAt[enemy.y][enemy.x] == -1)
+                {
+                    enemyAt[enemy.y][enemy.x] = enemyCount;
+                    enemies[enemyCount++] = enemy;
+                }
+                else
+                    chunk->enemies[kept++] = chunk->enemies[i];
+            }
+            chunk->enemyCount = kept;
+
+            for (int i = 0; i < chunk->roomCount; i++)
+            {
+                Room room = chunk->rooms[i];
+                room.x -= worldLeft;
+                room.y -= worldTop;
+                room.centerX -= worldLeft;
+                room.centerY -= worldTop;
+                if (room.x < 0 || room.y < 0 || room.x + room.width > MAP_WIDTH || room.y + room.height > MAP_HEIGHT)
+                    continue;
+                choices[choiceCount++] =
+                    (RoomChoice){room, abs(room.centerX - playerX) + abs(room.centerY - playerY)};
             }
-            map[y][x] = FLOOR;
-            mvprintw(0, 0, "You picked up %s! Quantity now: %d", allWeaponTypes[i].name, playerInventory[i].quantity);
-            return;
         }
     }
-}
 
-void displayInventory()
-{
-    clear();
-    mvprintw(0, 0, "======= Inventory =======\n");
-    mvprintw(2, 0, "Melee Weapons:\n");
-    int line = 3;
-    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    qsort(choices, choiceCount, sizeof(RoomChoice), compareRoomChoices);
+    int room_count = choiceCount < MAX_ROOMS ? choiceCount : MAX_ROOMS;
+    memset(rooms, 0, sizeof(Room) * MAX_ROOMS);
+    for (int i = 0; i < room_count; i++)
+        rooms[i] = choices[i].room;
+
+    // Rooms are linked where a corridor joins their doors
+    buildDoorGraph(map, rooms, room_count);
+    buildCellIndexes(map);
+    clearRoomGraph();
+    for (int i = 0; i < doorCount; i++)
     {
-        if (allWeaponTypes[i].category == WEAPON_CATEGORY_MELEE)
+        for (int e = doors[i].firstEdge; e < doors[i].firstEdge + doors[i].edgeCount; e++)
         {
-            mvprintw(line++, 0, "  %c) %s [Qty:%d, Dmg:%d]", allWeaponTypes[i].icon, allWeaponTypes[i].name, playerInventory[i].quantity, allWeaponTypes[i].damage);
+            DoorNode *other = &doors[doorEdges[e].to];
+            if (doors[i].room != -1 && other->room != -1 && other->room != doors[i].room &&
+                roomLinkBetween(doors[i].room, other->room) == -1)
+                addRoomLink(doors[i].room, other->room, doors[i].cell, other->cell, doorEdges[e].length);
         }
     }
-    line++;
-    mvprintw(line++, 0, "Ranged Weapons:\n");
-    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+    clearPathCache();
+    return room_count;
+}
+
+// Give everything in the window back to the chunks under it
+void storeWindow(Room rooms[MAX_ROOMS], int room_count)
+{
+    int firstCx = floorDiv(worldLeft, CHUNK_SIZE), lastCx = floorDiv(worldLeft + MAP_WIDTH - 1, CHUNK_SIZE);
+    int firstCy = floorDiv(worldTop, CHUNK_SIZE), lastCy = floorDiv(worldTop + MAP_HEIGHT - 1, CHUNK_SIZE);
+    for (int cy = firstCy; cy <= lastCy; cy++)
     {
-        if (allWeaponTypes[i].category == WEAPON_CATEGORY_RANGED)
+        for (int cx = firstCx; cx <= lastCx; cx++)
         {
-            mvprintw(line++, 0, "  %c) %s [Qty:%d, Range:%d, Dmg:%d]", allWeaponTypes[i].icon, allWeaponTypes[i].name, playerInventory[i].quantity, allWeaponTypes[i].maxDistance, allWeaponTypes[i].damage);
+            Chunk *chunk = needChunk(cx, cy);
+            int left = cx * CHUNK_SIZE - worldLeft, top = cy * CHUNK_SIZE - worldTop;
+            int fromX = left > 0 ? left : 0, toX = left + CHUNK_SIZE < MAP_WIDTH ? left + CHUNK_SIZE : MAP_WIDTH;
+            int fromY = top > 0 ? top : 0, toY = top + CHUNK_SIZE < MAP_HEIGHT ? top + CHUNK_SIZE : MAP_HEIGHT;
+            for (int y = fromY; y < toY; y++)
+                for (int x = fromX; x < toX; x++)
+                    setGridBit(&chunk->explored[0][0], CHUNK_ROW_WORDS, x - left, y - top, hasCell(&explored, x, y));
         }
     }
-    line += 2;
-    mvprintw(line++, 0, "Press the character of the weapon to equip it, or ESC to cancel.\n");
-    mvprintw(line++, 0, "If you already have a weapon equipped, please press 'w' first to store it.\n");
-    refresh();
-    int ch = getch();
-    if (ch == 27)
+
+    for (int i = 0; i < room_count; i++)
     {
-        return;
+        int x = rooms[i].x + worldLeft, y = rooms[i].y + worldTop;
+        Chunk *chunk = needChunk(floorDiv(x, CHUNK_SIZE), floorDiv(y, CHUNK_SIZE));
+        for (int j = 0; j < chunk->roomCount; j++)
+        {
+            if (chunk->rooms[j].x == x && chunk->rooms[j].y == y)
+            {
+                chunk->rooms[j].visited = rooms[i].visited;
+                chunk->rooms[j].lastSimulatedTurn = rooms[i].lastSimulatedTurn;
+            }
+        }
     }
-    char weaponChar = (char)ch;
-    int found = -1;
-    for (int i = 0; i < MAX_WEAPON_TYPES; i++)
+
+    for (int cell = 0; cell < MAP_HEIGHT * MAP_WIDTH; cell++)
     {
-        if (weaponChar == allWeaponTypes[i].icon)
+        int x = cell % MAP_WIDTH + worldLeft, y = cell / MAP_WIDTH + worldTop;
+        Chunk *chunk = NULL;
+        for (int id = itemAt[cell / MAP_WIDTH][cell % MAP_WIDTH]; id != -1; id = itemPool[id].next)
         {
-            found = i;
-            break;
+            if (!chunk)
+                chunk = needChunk(floorDiv(x, CHUNK_SIZE), floorDiv(y, CHUNK_SIZE));
+            if (chunk->itemCount < CHUNK_MAX_ITEMS)
+                chunk->items[chunk->itemCount++] =
+                    (ChunkItem){(y - chunk->cy * CHUNK_SIZE) * CHUNK_SIZE + x - chunk->cx * CHUNK_SIZE,
+                                itemPool[id].quantity, itemPool[id].kind, itemPool[id].subtype};
         }
     }
-    if (found == -1)
+
+    for (int i = 0; i < enemyCount; i++)
+    {
+        Enemy enemy = enemies[i];
+        if (enemy.damageThreshold <= 0)
+            continue;
+        enemy.x += worldLeft;
+        enemy.y += worldTop;
+        enemy.isActive = 0;
+        enemy.scheduled = false;
+        Chunk *chunk = needChunk(floorDiv(enemy.x, CHUNK_SIZE), floorDiv(enemy.y, CHUNK_SIZE));
+        if (chunk->enemyCount < CHUNK_MAX_ENEMIES)
+            chunk->enemies[chunk->enemyCount++] = enemy;
+    }
+}
+
+// Start in the first room of chunk (0, 0). Returns the room count.
+int enterOverworld(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS])
+{
+    if (!worldDir[0])
     {
-        mvprintw(line++, 0, "That weapon does not exist. Press any key to continue.");
-        getch();
+        strcpy(worldDir, "/tmp/game3-world-XXXXXX");
+        worldDirIsScratch = mkdtemp(worldDir) != NULL;
+        if (!worldDirIsScratch)
+            worldDir[0] = '\0'; // chunks that leave memory are generated again
+    }
+    else
+        mkdir(worldDir, 0755); // may be there from an earlier game
+
+    Chunk *home = needChunk(0, 0);
+    int startX = home->roomCount > 0 ? home->rooms[0].centerX : CHUNK_SIZE / 2;
+    int startY = home->roomCount > 0 ? home->rooms[0].centerY : CHUNK_SIZE / 2;
+    worldLeft = startX - MAP_WIDTH / 2;
+    worldTop = startY - MAP_HEIGHT / 2;
+    playerX = startX - worldLeft;
+    playerY = startY - worldTop;
+    int room_count = composeWindow(map, rooms);
+    resetFloorView(); // a kept world may have been explored already
+    return room_count;
+}
+
+// Move the window when the player gets near its edge
+void followPlayerInWorld(Player *player, Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[MAX_ROOMS], int *room_count)
+{
+    if (!overworld || (playerX >= WINDOW_EDGE_X && playerX < MAP_WIDTH - WINDOW_EDGE_X &&
+                       playerY >= WINDOW_EDGE_Y && playerY < MAP_HEIGHT - WINDOW_EDGE_Y))
+        return;
+    long start = nowUs();
+    int worldX = worldLeft + playerX, worldY = worldTop + playerY;
+    leaveLevel(rooms);
+    storeWindow(rooms, *room_count);
+    worldLeft = worldX - MAP_WIDTH / 2;
+    worldTop = worldY - MAP_HEIGHT / 2;
+    playerX = worldX - worldLeft;
+    playerY = worldY - worldTop;
+    *room_count = composeWindow(map, rooms);
+    arriveOnLevel(player, map, rooms, *room_count);
+    windowMoveUs += nowUs() - start;
+    windowMoves++;
+}
+
+// At the end of the game: a world kept in --world-dir gets every chunk
+// written, a scratch one is removed
+void leaveOverworld(Room rooms[MAX_ROOMS], int room_count)
+{
+    if (!overworld || !worldDir[0])
+        return;
+    if (!worldDirIsScratch)
+    {
+        storeWindow(rooms, room_count);
+        for (int i = 0; i < RESIDENT_CHUNKS; i++)
+            if (chunks[i].used)
+                writeChunk(&chunks[i]);
         return;
     }
-    if (playerInventory[found].quantity <= 0 && !allWeaponTypes[found].permanent && found != WT_MACE)
+    DIR *dir = opendir(worldDir);
+    if (dir)
     {
-        mvprintw(line++, 0, "No quantity left. Press any key to continue.");
-        getch();
+        struct dirent *entry;
+        char path[sizeof(worldDir) + 256];
+        while ((entry = readdir(dir)))
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            snprintf(path, sizeof(path), "%s/%s", worldDir, entry->d_name);
+            unlink(path);
+        }
+        closedir(dir);
+    }
+    rmdir(worldDir);
+}
+
+//----------------------------------------------------------------------------
+// LEVEL CHECK
+//----------------------------------------------------------------------------
+// --check-levels N builds levels for N seeds on all cores and flood-fills
+// each one from the start cell: every room, item and stairs must be
+// reachable on foot. The levels are built as floor 2, which has stairs both
+// ways. Failures are listed by seed together with a histogram
+// of generation times. Workers are forked processes, unlike the threads of
+// --simulate (see SIMULATION): a level that crashes its worker takes only
+// that worker down and is reported, and every worker has its own copy of
+// memory, so the plain static buffers here (floodFill's queue, checkLevel's
+// reached cells, checkLevelsWorker's map) are never shared. Each worker
+// takes seeds in blocks from a counter in shared memory and rebuilds its
+// level state from scratch for every seed.
+#define CHECK_BLOCK 256       // seeds taken from the counter at a time
+#define CHECK_MAX_FAILURES 20 // failures listed with their seed
+#define CHECK_TIME_BUCKETS 24 // powers of two of microseconds
+#define CHECK_DEPTH 2         // the first floor with both stairs
+
+typedef enum
+{
+    LEVEL_OK,
+    LEVEL_MISSING_ROOMS,      // fewer rooms generated than used
+    LEVEL_ROOM_UNREACHABLE,
+    LEVEL_ITEM_UNREACHABLE,
+    LEVEL_STAIRS_UNREACHABLE,
+    LEVEL_FAILURE_KINDS
+} LevelFailure;
+
+static const char *levelFailureNames[LEVEL_FAILURE_KINDS] = {
+    "ok", "rooms used but never generated", "room unreachable", "item unreachable", "stairs unreachable"};
+
+typedef struct
+{
+    unsigned seed;
+    int kind;
+    int detail; // room index or item cell
+} CheckFailure;
+
+typedef struct
+{
+    long nextSeed;
+    long failureCount;
+    long byKind[LEVEL_FAILURE_KINDS];
+    long timeHistogram[CHECK_TIME_BUCKETS];
+    long slowestUs;
+    CheckFailure failures[CHECK_MAX_FAILURES];
+} CheckShared;
+
+// Which cells can be walked to from (x0, y0)
+void floodFill(Tile map[MAP_HEIGHT][MAP_WIDTH], int x0, int y0, bool reached[MAP_HEIGHT][MAP_WIDTH])
+{
+    static int queue[MAP_HEIGHT * MAP_WIDTH];
+    for (int row = 0; row < MAP_HEIGHT; row++)
+        for (int col = 0; col < MAP_WIDTH; col++)
+            reached[row][col] = false;
+    if (!isWalkable(map, x0, y0))
         return;
-    }
-    if (currentWeaponType != WT_MACE && currentWeaponType != found)
+    int head = 0, tail = 0;
+    queue[tail++] = y0 * MAP_WIDTH + x0;
+    reached[y0][x0] = true;
+    while (head < tail)
     {
-        mvprintw(line++, 0, "Please return your currently equipped weapon first.\nPress any key to continue.");
-        getch();
-        return;
+        int x = queue[head] % MAP_WIDTH, y = queue[head] / MAP_WIDTH;
+        head++;
+        for (int d = 0; d < 4; d++)
+        {
+            int nx = x + stepDX[d], ny = y + stepDY[d];
+            if (isWalkable(map, nx, ny) && !reached[ny][nx])
+            {
+                reached[ny][nx] = true;
+                queue[tail++] = ny * MAP_WIDTH + nx;
+            }
+        }
     }
-    currentWeaponType = found;
-    mvprintw(line++, 0, "Equipped weapon: %s\nPress any key to continue.", allWeaponTypes[currentWeaponType].name);
-    getch();
 }
 
-void storeCurrentWeapon()
+LevelFailure checkLevel(Tile map[MAP_HEIGHT][MAP_WIDTH], Room rooms[], int room_count, int generated, int *detail)
 {
-    if (currentWeaponType != WT_MACE)
+    static bool reached[MAP_HEIGHT][MAP_WIDTH];
+    *detail = generated;
+    if (generated < room_count)
+        return LEVEL_MISSING_ROOMS;
+
+    floodFill(map, rooms[0].x + rooms[0].width / 2, rooms[0].y + rooms[0].height / 2, reached);
+    for (int i = 0; i < room_count; i++)
     {
-        currentWeaponType = WT_MACE;
-        mvprintw(0, 0, "Stored current weapon. Mace re-equipped.");
-        clrtoeol();
+        *detail = i;
+        if (!reached[rooms[i].centerY][rooms[i].centerX])
+            return LEVEL_ROOM_UNREACHABLE;
     }
-    else
+    for (int row = 0; row < MAP_HEIGHT; row++)
     {
-        mvprintw(0, 0, "Mace was already equipped. Nothing to store.");
-        clrtoeol();
+        for (int col = 0; col < MAP_WIDTH; col++)
+        {
+            *detail = row * MAP_WIDTH + col;
+            if (itemAt[row][col] != -1 && !reached[row][col])
+                return LEVEL_ITEM_UNREACHABLE;
+            if (TILE_HAS(map[row][col], TF_STAIRS) && !reached[row][col])
+                return LEVEL_STAIRS_UNREACHABLE;
+        }
     }
+    return LEVEL_OK;
 }
 
-void performMeleeAttack()
+void checkLevelsWorker(CheckShared *shared, long count, unsigned firstSeed)
 {
-    Weapon *wpn = getWeaponDef(currentWeaponType);
-    for (int dy = -1; dy <= 1; dy++)
+    static Tile map[MAP_HEIGHT][MAP_WIDTH];
+    while (true)
     {
-        for (int dx = -1; dx <= 1; dx++)
+        long block = __atomic_fetch_add(&shared->nextSeed, CHECK_BLOCK, __ATOMIC_RELAXED);
+        if (block >= count)
+            return;
+        for (long i = block; i < block + CHECK_BLOCK && i < count; i++)
         {
-            if (dx == 0 && dy == 0)
+            unsigned seed = firstSeed + (unsigned)i;
+            Room rooms[MAX_ROOMS] = {0};
+            int generated, detail;
+            seedRandom(seed);
+            long start = nowUs();
+            int room_count = buildLevel(map, rooms, CHECK_DEPTH, &generated);
+            long spent = nowUs() - start;
+
+            int bucket = 0;
+            while ((1L << bucket) <= spent && bucket < CHECK_TIME_BUCKETS - 1)
+                bucket++;
+            __atomic_fetch_add(&shared->timeHistogram[bucket], 1, __ATOMIC_RELAXED);
+            long slowest = __atomic_load_n(&shared->slowestUs, __ATOMIC_RELAXED);
+            while (spent > slowest &&
+                   !__atomic_compare_exchange_n(&shared->slowestUs, &slowest, spent, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                ;
+
+            LevelFailure kind = checkLevel(map, rooms, room_count, generated, &detail);
+            __atomic_fetch_add(&shared->byKind[kind], 1, __ATOMIC_RELAXED);
+            if (kind == LEVEL_OK)
                 continue;
-            int nx = playerX + dx;
-            int ny = playerY + dy;
-            int eIndex = getEnemyIndexAt(nx, ny);
-            if (eIndex != -1)
-            {
-                damageEnemy(eIndex, wpn->damage, wpn->canStun);
-            }
+            long slot = __atomic_fetch_add(&shared->failureCount, 1, __ATOMIC_RELAXED);
+            if (slot < CHECK_MAX_FAILURES)
+                shared->failures[slot] = (CheckFailure){seed, kind, detail};
         }
     }
 }
 
-void performRangedAttack(int direction, char map[MAP_HEIGHT][MAP_WIDTH])
+void checkLevels(long count, int jobs, unsigned firstSeed)
 {
-    if (direction < 0)
-        return;
-    Weapon *wpn = getWeaponDef(currentWeaponType);
-    if (playerInventory[currentWeaponType].quantity <= 0 && !wpn->permanent)
+    CheckShared *shared = mmap(NULL, sizeof(CheckShared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED)
     {
-        mvprintw(0, 0, "No ammo left for %s!", wpn->name);
-        return;
-    }
-    int dx = 0, dy = 0;
-    switch (direction)
-    {
-    case KEY_UP:
-        dy = -1;
-        break;
-    case KEY_DOWN:
-        dy = 1;
-        break;
-    case KEY_LEFT:
-        dx = -1;
-        break;
-    case KEY_RIGHT:
-        dx = 1;
-        break;
+        perror("mmap");
+        exit(1);
     }
-    int travel = 0;
-    int maxDist = wpn->maxDistance;
-    int cx = playerX;
-    int cy = playerY;
-    while (travel < maxDist)
+    memset(shared, 0, sizeof(CheckShared));
+    fflush(stdout);
+    long start = nowUs();
+    for (int w = 0; w < jobs; w++)
     {
-        cx += dx;
-        cy += dy;
-        travel++;
-        if (cx < 0 || cx >= MAP_WIDTH || cy < 0 || cy >= MAP_HEIGHT)
-        {
-            mvprintw(0, 0, "Projectile flew out of bounds and is lost!");
-            break;
-        }
-        if (map[cy][cx] == WALL)
+        if (fork() == 0)
         {
-            mvprintw(0, 0, "Projectile hit a wall at (%d,%d). It fell to the ground.", cx, cy);
-            break;
-        }
-        int eIndex = getEnemyIndexAt(cx, cy);
-        if (eIndex != -1)
-        {
-            damageEnemy(eIndex, wpn->damage, wpn->canStun);
-            mvprintw(0, 40, "Projectile hit Enemy index %d at (%d, %d).", eIndex, cx, cy);
-            break;
+            checkLevelsWorker(shared, count, firstSeed);
+            _exit(0);
         }
     }
-    if (!wpn->permanent)
+    int crashedWorkers = 0, status;
+    while (wait(&status) > 0)
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            crashedWorkers++;
+    double seconds = (nowUs() - start) / 1e6;
+
+    printf("levels: %ld (seeds %u..%u), %d workers, %.0f levels/s\n", count, firstSeed,
+           firstSeed + (unsigned)count - 1, jobs, count / seconds);
+    if (crashedWorkers)
+        printf("CRASHED workers: %d (their remaining seeds were not checked)\n", crashedWorkers);
+    for (int k = 0; k < LEVEL_FAILURE_KINDS; k++)
+        printf("  %-32s %ld\n", levelFailureNames[k], shared->byKind[k]);
+    for (long i = 0; i < shared->failureCount && i < CHECK_MAX_FAILURES; i++)
     {
-        playerInventory[currentWeaponType].quantity--;
-        if (playerInventory[currentWeaponType].quantity < 0)
-            playerInventory[currentWeaponType].quantity = 0;
+        CheckFailure *f = &shared->failures[i];
+        if (f->kind == LEVEL_ITEM_UNREACHABLE || f->kind == LEVEL_STAIRS_UNREACHABLE)
+            printf("  seed %u: %s at %d,%d\n", f->seed, levelFailureNames[f->kind], f->detail % MAP_WIDTH, f->detail / MAP_WIDTH);
+        else if (f->kind == LEVEL_ROOM_UNREACHABLE)
+            printf("  seed %u: %s (room %d)\n", f->seed, levelFailureNames[f->kind], f->detail);
+        else
+            printf("  seed %u: %s (%d generated, %d used)\n", f->seed, levelFailureNames[f->kind], f->detail, MIN_ROOMS);
     }
+    printf("generation time (us):\n");
+    for (int b = 0; b < CHECK_TIME_BUCKETS; b++)
+        if (shared->timeHistogram[b])
+            printf("  < %-8ld %ld\n", 1L << b, shared->timeHistogram[b]);
+    printf("  slowest  %ld\n", shared->slowestUs);
+    exit(shared->failureCount > 0 || crashedWorkers ? 2 : 0);
+}
+
+//----------------------------------------------------------------------------
+// VIEWPORT CHECK
+//----------------------------------------------------------------------------
+// --check-viewport builds a level headless, marks all of it explored and walks
+// the player around it in a view smaller than the map: along the top edge,
+// down the right one, back along the bottom and up the left, first one cell
+// a step and then several. After every step the view must match the pad at
+// the camera; this covers the scroll and row-shift paths of moveCamera,
+// which a view as big as the map never takes.
+#define CHECK_VIEW_COLS 30
+#define CHECK_VIEW_ROWS 10
+
+// Cells of the view that differ from the pad under the camera
+int viewMismatches()
+{
+    int wrong = 0;
+    for (int row = 0; row < viewHeight; row++)
+        for (int col = 0; col < viewWidth; col++)
+            if (surfGet(mapWin, row, col) != surfGet(terrainPad, camY + row, camX + col))
+                wrong++;
+    return wrong;
 }
 
-void playerAttack(int repeat, char map[MAP_HEIGHT][MAP_WIDTH])
+void checkViewport(unsigned seed)
 {
-    Weapon *wpn = getWeaponDef(currentWeaponType);
-    if (wpn->category == WEAPON_CATEGORY_MELEE)
+    static Tile map[MAP_HEIGHT][MAP_WIDTH];
+    Room rooms[MAX_ROOMS] = {0};
+    headless = true;
+    screenCols = CHECK_VIEW_COLS;
+    screenRows = CHECK_VIEW_ROWS + 2;
+    initViewport();
+    seedRandom(seed);
+    buildLevel(map, rooms, 1, NULL);
+    for (int row = 0; row < MAP_HEIGHT; row++)
     {
-        performMeleeAttack();
-        return;
+        for (int col = 0; col < MAP_WIDTH; col++)
+        {
+            addCell(&explored, col, row);
+            markCellDirty(col, row);
+        }
     }
-    else
+    playerX = playerY = camX = camY = 0;
+    flushTerrainPad(map);
+
+    static const char *dirNames[4] = {"right", "down", "left", "up"};
+    int scrolls[4] = {0};
+    long wrong = viewMismatches();
+    for (int stride = 1; stride <= 3; stride += 2)
     {
-        if (repeat && lastShotDirection != -1)
+        for (int d = 0; d < 4; d++)
         {
-            performRangedAttack(lastShotDirection, map);
-            return;
+            int dx = d == 0 ? 1 : d == 2 ? -1 : 0;
+            int dy = d == 1 ? 1 : d == 3 ? -1 : 0;
+            int steps = (dx ? MAP_WIDTH : MAP_HEIGHT) - 1;
+            for (int s = 0; s < steps; s += stride)
+            {
+                int step = s + stride <= steps ? stride : steps - s;
+                int oldCamX = camX, oldCamY = camY;
+                playerX += dx * step;
+                playerY += dy * step;
+                moveCamera();
+                if (camX != oldCamX || camY != oldCamY)
+                    scrolls[d]++;
+                wrong += viewMismatches();
+            }
         }
-        mvprintw(0, 0, "Press an arrow key to shoot. (Up/Down/Left/Right)");
-        int dir = getch();
-        lastShotDirection = dir;
-        performRangedAttack(dir, map);
     }
+
+    printf("viewport: %dx%d view on a %dx%d map, seed %u\n", viewWidth, viewHeight, MAP_WIDTH, MAP_HEIGHT, seed);
+    bool failed = wrong > 0;
+    for (int d = 0; d < 4; d++)
+    {
+        printf("  camera moves %-5s %d\n", dirNames[d], scrolls[d]);
+        if (scrolls[d] == 0)
+            failed = true;
+    }
+    printf("  cells wrong       %ld\n", wrong);
+    exit(failed ? 2 : 0);
 }
 
 //----------------------------------------------------------------------------
-// MAIN
+// SIMULATION
 //----------------------------------------------------------------------------
-int main()
+// --simulate N plays N bot games on all cores. Everything a game changes is
+// thread-local and the settings from the command line are only read, so a
+// game needs nothing but a thread of its own to start from untouched state:
+// a worker per core takes the next seed from a counter shared by all workers
+// (whoever is free takes the next game, so slow games do not hold up a core)
+// and plays it on a fresh thread, which files one GameResult and ends.
+// Nothing is shared between two games. A game still going after
+// SIM_GAME_TIMEOUT seconds is stopped at the bot's next command; a game that
+// crashes takes the whole run with it.
+#define SIM_GAME_TIMEOUT 60 // seconds before a game counts as hung
+
+typedef struct
+{
+    bool done, timedOut, died;
+    int worker;
+    long turns;
+    int gold;
+    int floor;  // deepest floor reached
+    int killer; // EnemyType, or -1
+    long micros;
+} GameResult;
+
+_Thread_local GameResult *simResult = NULL; // set on the thread that plays a simulated game
+
+typedef struct
+{
+    long games;
+    unsigned firstSeed;
+    long nextGame;
+    GameResult *results;
+} SimShared;
+
+typedef struct
+{
+    SimShared *shared;
+    int worker;
+} SimWorker;
+
+typedef struct
+{
+    GameResult *result;
+    unsigned seed;
+} SimGame;
+
+int playGame(unsigned seed);
+
+int compareLongs(const void *a, const void *b)
 {
-    srand((unsigned)time(NULL));
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
 
-    initscr();
-    keypad(stdscr, TRUE);
-    noecho();
-    curs_set(0);
+void reportSimulation(SimShared *shared, int jobs, double seconds)
+{
+    long games = shared->games;
+    unsigned firstSeed = shared->firstSeed;
+    long died = 0, failed = 0, limit = 0, goldTotal = 0, turnsTotal = 0, floorTotal = 0;
+    long deathsBy[ENEMY_TYPE_COUNT + 1] = {0}; // last slot: unknown
+    long *survival = malloc(sizeof(long) * games);
+    long perWorker[jobs];
+    for (int w = 0; w < jobs; w++)
+        perWorker[w] = 0;
+    int maxGold = 0, maxFloor = 0;
 
-    if (has_colors() == FALSE)
+    for (long i = 0; i < games; i++)
     {
-        endwin();
-        printf("sistem shoma az rang poshtibani nemikonad\n");
-        exit(1);
+        GameResult *r = &shared->results[i];
+        perWorker[r->worker]++;
+        if (r->timedOut || !r->done)
+        {
+            failed++;
+            printf("%s: seed %u\n", r->timedOut ? "timed out" : "not played", firstSeed + (unsigned)i);
+            continue;
+        }
+        turnsTotal += r->turns;
+        goldTotal += r->gold;
+        if (r->gold > maxGold)
+            maxGold = r->gold;
+        floorTotal += r->floor;
+        if (r->floor > maxFloor)
+            maxFloor = r->floor;
+        if (r->died)
+        {
+            survival[died++] = r->turns;
+            deathsBy[r->killer >= 0 && r->killer < ENEMY_TYPE_COUNT ? r->killer : ENEMY_TYPE_COUNT]++;
+        }
+        else if (r->turns >= botMaxTurns)
+            limit++;
     }
-    start_color();
-    init_pair(1, COLOR_YELLOW, COLOR_BLACK); // talaye adi
-    init_pair(2, COLOR_RED, COLOR_BLACK);    // talaye siyah
+    long finished = games - failed;
 
-    // Allocate dungeon map and visibility array
-    char map[MAP_HEIGHT][MAP_WIDTH];
-    bool visible[MAP_HEIGHT][MAP_WIDTH];
-    init_map(map);
+    printf("games: %ld (seeds %u..%u), bot %s, %d workers\n", games, firstSeed, firstSeed + (unsigned)games - 1,
+           activeBot->name, jobs);
+    printf("results: %ld died, %ld reached %ld turns, %ld stopped, %ld timed out or not played\n",
+           died, limit, botMaxTurns, finished - died - limit, failed);
+    if (finished > 0)
+        printf("turns: %.1f avg   gold: %.1f avg, %d max   floor: %.1f avg, %d max\n",
+               (double)turnsTotal / finished, (double)goldTotal / finished, maxGold,
+               (double)floorTotal / finished, maxFloor);
+    if (died > 0)
+    {
+        qsort(survival, died, sizeof(long), compareLongs);
+        printf("survival turns (deaths): p10 %ld, median %ld, p90 %ld\n",
+               survival[died / 10], survival[died / 2], survival[died * 9 / 10]);
+        printf("deaths by enemy:");
+        for (int t = 0; t < ENEMY_TYPE_COUNT; t++)
+            printf("  %s %ld", enemyTypeNames[t], deathsBy[t]);
+        if (deathsBy[ENEMY_TYPE_COUNT])
+            printf("  unknown %ld", deathsBy[ENEMY_TYPE_COUNT]);
+        printf("\n");
+    }
+    printf("speed: %.1f games/s, %.1f games/s per core (", games / seconds, games / seconds / jobs);
+    for (int w = 0; w < jobs; w++)
+        printf(w ? " %.1f" : "%.1f", perWorker[w] / seconds);
+    printf(")\n");
+    free(survival);
+}
+
+// Runs on a thread of its own, so the game starts from fresh state
+void *playSimulatedGame(void *arg)
+{
+    SimGame *game = arg;
+    simResult = game->result;
+    botDeadlineUs = nowUs() + SIM_GAME_TIMEOUT * 1000000L;
+    playGame(game->seed);
+    return NULL;
+}
 
-    // Reserve memory for our rooms and create them
-    Room rooms[MAX_ROOMS];
-    int room_count = generate_rooms(rooms, MAX_ROOMS, map);
+void *simulationWorker(void *arg)
+{
+    SimWorker *worker = arg;
+    SimShared *shared = worker->shared;
+    while (true)
+    {
+        long game = __atomic_fetch_add(&shared->nextGame, 1, __ATOMIC_RELAXED);
+        if (game >= shared->games)
+            return NULL;
+        SimGame job = {&shared->results[game], shared->firstSeed + (unsigned)game};
+        job.result->worker = worker->worker;
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, playSimulatedGame, &job) == 0)
+            pthread_join(thread, NULL);
+    }
+}
 
-    // Ensure we generate at least MIN_ROOMS for a decent dungeon
-    if (room_count < MIN_ROOMS)
-        room_count = MIN_ROOMS;
+void runSimulation(long games, int jobs, unsigned firstSeed)
+{
+    SimShared shared = {games, firstSeed, 0, calloc(games, sizeof(GameResult))};
+    SimWorker workers[jobs];
+    pthread_t threads[jobs];
+    fflush(stdout);
+    long start = nowUs();
 
-    // Draw each room
-    for (int i = 0; i < room_count; i++)
+    int started = 0;
+    for (int w = 0; w < jobs; w++)
     {
-        draw_room(map, rooms[i]);
+        workers[w] = (SimWorker){&shared, w};
+        if (pthread_create(&threads[started], NULL, simulationWorker, &workers[w]) == 0)
+            started++;
     }
+    for (int w = 0; w < started; w++)
+        pthread_join(threads[w], NULL);
+
+    reportSimulation(&shared, jobs, (nowUs() - start) / 1e6);
+    free(shared.results);
+    exit(0);
+}
 
-    // Connect rooms with corridors
-    for (int i = 1; i < room_count; i++)
+//----------------------------------------------------------------------------
+// GAME
+//----------------------------------------------------------------------------
+// Hand back what a game allocated. Only a simulated game has to: its thread
+// ends, but the process goes on with the next game.
+void freeGame()
+{
+    joinFloorWorker();
+    free(floorJob.result);
+    floorJob.result = NULL;
+    for (int depth = 1; depth <= MAX_FLOORS; depth++)
     {
-        int prev_centerX = rooms[i - 1].centerX;
-        int prev_centerY = rooms[i - 1].centerY;
-        int curr_centerX = rooms[i].centerX;
-        int curr_centerY = rooms[i].centerY;
-        draw_corridor(map, prev_centerX, prev_centerY, curr_centerX, curr_centerY);
+        free(floorCache[depth].packed);
+        floorCache[depth].packed = NULL;
     }
+    if (spillFile)
+        fclose(spillFile);
+    spillFile = NULL;
+    clearPathCache();
+    freeSurface(statusWin);
+    freeSurface(msgWin);
+    freeSurface(mapWin);
+    freeSurface(terrainPad);
+}
+
+// One game from the first floor to its end: on the terminal, headless, or
+// played by the bot on a simulation thread. Returns the exit code.
+int playGame(unsigned seed)
+{
+    seedRandom(seed);
+    initViewport();
+
+    // Allocate dungeon map and visibility array
+    Tile map[MAP_HEIGHT][MAP_WIDTH];
+    CellSet visible = {0};
+    Room rooms[MAX_ROOMS] = {0};
+    gameSeed = seed;
+    int room_count = overworld ? enterOverworld(map, rooms) : buildLevel(map, rooms, 1, NULL);
 
     // Initialize player
     Player player = {0, 0, 100, 0, 0}; // Initial health, gold, and hunger
 
     // Place the player in the first room
-    playerX = rooms[0].x + rooms[0].width / 2;
-    playerY = rooms[0].y + rooms[0].height / 2;
-    rooms[0].visited = true; // Mark first room as visited
-
-    placeRegularGold(map);
-    placeBlackGold(map);
-    placeFood(map);
-    placeWeapons(map);
-
-    for (int i = 0; i < room_count; i++)
+    if (!overworld)
     {
-        placeEnemiesInRoom(rooms[i], enemies, &enemyCount);
+        playerX = rooms[0].x + rooms[0].width / 2;
+        playerY = rooms[0].y + rooms[0].height / 2;
     }
+    playerRoomIndex = roomIndexAt(room_count, rooms, playerX, playerY);
+    if (playerRoomIndex != -1)
+        rooms[playerRoomIndex].visited = true; // Mark first room as visited
 
     display_map(map);
 
-    bool all_visible[MAP_HEIGHT][MAP_WIDTH];
-    // make them all be true
-    for (int i = 0; i < MAP_HEIGHT; i++)
+    initializePlayerInventory();
+
+    // Start the turn scheduler: hunger clock and the enemies that see the player
+    scheduleEvent(currentTurn + HUNGER_TICK_INTERVAL, EV_HUNGER_TICK, 0);
+    noticePlayer(map);
+    if (!overworld)
+        startFloorWorker(2);
+
+    botView.player = &player;
+    botView.map = map;
+    botView.visible = &visible;
+    long gameStart = nowUs();
+    bool died = false;
+
+    // Render cost only: drawing into the surfaces, not terminal output
+    long renderUs = 0, renderStart = nowUs();
+    long renderFrames = 1;
+    printDungeon(map, &visible, &player);
+    renderUs += nowUs() - renderStart;
+
+    if (realTime)
     {
-        for (int j = 0; j < MAP_WIDTH; j++)
-        {
-            all_visible[i][j] = true;
-        }
+        runRealTime(&player, map, &visible, rooms, &room_count);
+        joinFloorWorker();
+        leaveOverworld(rooms, room_count);
+        display_final_score();
+        endwin();
+        printf("ticks: %ld, sim %.1f us avg / %ld us max per tick (budget %d us), %ld late\n",
+               tickCount, tickCount ? (double)tickUsTotal / tickCount : 0.0, tickUsMax, TICK_MS * 1000, ticksLate);
+        return 0;
     }
 
-    initializePlayerInventory();
-    placeWeaponsOnMap();
-
     // Input loop
     int ch;
-    while ((ch = getch()) != 'q')
+    // Headless runs have no clock to wait on: a flying projectile takes the
+    // place of the key until it lands
+    while ((ch = (headless && projectilesInFlight()) ? ERR : readKey(NULL)) != 'q')
     {
-        int newX = playerX;
-        int newY = playerY;
-
-        if (ch == KEY_UP)
-            newY--;
-        else if (ch == KEY_DOWN)
-            newY++;
-        else if (ch == KEY_LEFT)
-            newX--;
-        else if (ch == KEY_RIGHT)
-            newX++;
-        else if (ch == 'E' || ch == 'e')
-        {
-            showFoodMenu(&player);
-            // pardazesh entekhab va be-rozresani salamat/goshnegi
-        }
-        else if (ch == 'i')
+        // No key within a frame: just animate what is still flying
+        if (ch == ERR)
         {
-            displayInventory();
+            updateProjectiles(map);
+            printDungeon(map, &visible, &player);
+            setInputTimeout(projectilesInFlight() ? PROJECTILE_FRAME_MS : -1);
+            continue;
         }
-        else if (ch == 'w')
+        setInputTimeout(-1); // menus and prompts below wait for their key
+        messageLine[0] = '\0';
+
+        int healthBefore = player.health;
+        int enemiesBefore = countVisibleEnemies(&visible);
+        if (runDirection(ch) != -1)
+            runPlayer(runDirection(ch), &player, map, &visible, rooms, room_count);
+        else if (ch == 'g')
+            travelPrompt(&player, map, &visible, rooms, room_count);
+        else if (ch == 'o')
+            autoExplore(&player, map, &visible, rooms, room_count);
+        else if (ch == '>' || ch == '<')
         {
-            storeCurrentWeapon();
+            if (useStairs(ch, &player, map, rooms, &room_count))
+                advanceTurn(&player, map);
         }
-        else if (ch == ' ')
+        else
         {
-            playerAttack(0, map);
+            handlePlayerKey(ch, &player, map, rooms, room_count);
+            advanceTurn(&player, map);
+            if (isMoveKey(ch))
+                drainQueuedMoves(&player, map, &visible, rooms, room_count, healthBefore, enemiesBefore);
         }
-        else if (ch == 'a')
+        followPlayerInWorld(&player, map, rooms, &room_count);
+        if (player.health <= 0)
         {
-            playerAttack(1, map);
+            setMessage("shoma mordid!");
+            died = true;
+            break;
         }
 
-        // Check if the new position is walkable
-        if (isWalkable(map, newX, newY))
-        {
-            playerX = newX;
-            playerY = newY;
+        updateProjectiles(map);
+        renderStart = nowUs();
+        printDungeon(map, &visible, &player);
+        renderUs += nowUs() - renderStart;
+        renderFrames++;
+        setInputTimeout(projectilesInFlight() ? PROJECTILE_FRAME_MS : -1);
+    }
+
+    joinFloorWorker();
+    leaveOverworld(rooms, room_count);
+    if (simResult)
+    {
+        simResult->turns = currentTurn;
+        simResult->gold = playerGold;
+        simResult->floor = deepestFloor;
+        simResult->died = died;
+        simResult->killer = died ? lastHitBy : -1;
+        simResult->micros = nowUs() - gameStart;
+        simResult->timedOut = botTimedOut;
+        simResult->done = true;
+        freeGame();
+        return 0;
+    }
+    if (activeBot)
+    {
+        double seconds = (nowUs() - gameStart) / 1e6;
+        printf("bot=%s seed=%u result=%s turns=%ld floor=%d gold=%d health=%d time=%.3fs turns/s=%.0f\n",
+               activeBot->name, seed, died ? "died" : currentTurn >= botMaxTurns ? "turn-limit" : "stopped",
+               currentTurn, deepestFloor, playerGold, player.health, seconds, seconds > 0 ? currentTurn / seconds : 0.0);
+        return 0;
+    }
 
-            // Update visited status for rooms
-            int rIndex = roomIndexAt(room_count, rooms, playerX, playerY);
-            if (rIndex != -1)
-                rooms[rIndex].visited = true;
+    display_final_score();
 
-            // Redraw dungeon with updated visibility
-        }
-        char cell = map[newY][newX];
-        if (cell == GOLD_ICON || cell == BLACK_GOLD_ICON)
+    // Cleanup ncurses
+    if (!headless)
+        endwin();
+    else
+    {
+        fprintf(stderr, "render: %ld frames, %.1f us per frame\n", renderFrames, (double)renderUs / renderFrames);
+        if (floorUnpacks > 0)
+            fprintf(stderr, "floors: %ld unpacked, %.1f us each, %ld spilled to disk, %ld read back\n",
+                    floorUnpacks, (double)floorUnpackUs / floorUnpacks, floorsSpilled, floorsReadBack);
+        if (sightQueries > 0)
+            fprintf(stderr, "sight: %ld queries, %ld traced\n", sightQueries, sightTraced);
+        if (windowMoves > 0)
+            fprintf(stderr, "world: window moved %ld times, %.1f us each; %ld chunks generated, %ld written, %ld read\n",
+                    windowMoves, (double)windowMoveUs / windowMoves, chunksGenerated, chunksWritten, chunksRead);
+    }
+    return 0;
+}
+
+//----------------------------------------------------------------------------
+// FRAME CHECK
+//----------------------------------------------------------------------------
+// --check-frames DIR plays the recorded games in DIR again headless and
+// compares what they draw with the frames recorded for them, byte for byte.
+// A game is two files named after the generator and the seed: NAME.keys
+// holds the keys as --headless reads them, NAME.frames what it wrote, e.g.
+//   ./game3.out --headless --generator bsp --seed 1 < frames/bsp-1.keys > frames/bsp-1.frames
+// Each game runs in a child process with its stdin on the keys and its
+// stdout on a temporary file, so it starts from untouched state and nothing
+// it prints reaches the report. The recordings use the default field of view
+// and window size; a change that is meant to alter what is drawn records
+// them again.
+
+int isKeysFile(const struct dirent *entry)
+{
+    size_t length = strlen(entry->d_name);
+    return length > 5 && strcmp(entry->d_name + length - 5, ".keys") == 0;
+}
+
+// Offset of the first byte where the two differ, or -1 when they are the same
+long firstDifference(FILE *a, FILE *b)
+{
+    for (long at = 0;; at++)
+    {
+        int ca = fgetc(a), cb = fgetc(b);
+        if (ca != cb)
+            return at;
+        if (ca == EOF)
+            return -1;
+    }
+}
+
+// Number of the frame the byte at offset belongs to in a headless recording
+long frameAt(FILE *frames, long offset)
+{
+    char line[MAX_FRAME_COLS + 2];
+    long frame = 0, frameNumber;
+    rewind(frames);
+    while (ftell(frames) <= offset && fgets(line, sizeof(line), frames))
+        if (sscanf(line, "---- frame %ld ----", &frameNumber) == 1)
+            frame = frameNumber;
+    return frame;
+}
+
+// Play one recorded game; false if it crashed or drew something else
+bool checkRecordedGame(const char *dirName, const char *name, int generator, unsigned seed)
+{
+    char keysPath[512], framesPath[512];
+    snprintf(keysPath, sizeof(keysPath), "%s/%s.keys", dirName, name);
+    snprintf(framesPath, sizeof(framesPath), "%s/%s.frames", dirName, name);
+    FILE *expected = fopen(framesPath, "rb");
+    if (!expected)
+    {
+        printf("  %-16s no %s.frames\n", name, name);
+        return false;
+    }
+    FILE *drawn = tmpfile();
+    if (!drawn)
+    {
+        perror("tmpfile");
+        exit(1);
+    }
+    fflush(stdout); // or the child writes what is still buffered again
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        if (!freopen(keysPath, "rb", stdin) || !freopen("/dev/null", "w", stderr))
+            _exit(1);
+        dup2(fileno(drawn), STDOUT_FILENO);
+        levelGenerator = generator;
+        headless = true;
+        realTime = false;
+        frameOut = stdout;
+        playGame(seed);
+        fflush(stdout);
+        _exit(0);
+    }
+    int status = 0;
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        printf("  %-16s crashed\n", name);
+        fclose(drawn);
+        fclose(expected);
+        return false;
+    }
+    rewind(drawn);
+    long at = firstDifference(drawn, expected);
+    if (at < 0)
+        printf("  %-16s ok, %ld bytes\n", name, ftell(expected));
+    else
+        printf("  %-16s differs at byte %ld, in frame %ld\n", name, at, frameAt(expected, at));
+    fclose(drawn);
+    fclose(expected);
+    return at < 0;
+}
+
+void checkFrames(const char *dirName)
+{
+    struct dirent **entries;
+    int count = scandir(dirName, &entries, isKeysFile, alphasort);
+    if (count < 0)
+    {
+        perror(dirName);
+        exit(1);
+    }
+    printf("frames: %d recorded games in %s\n", count, dirName);
+    int failed = 0;
+    for (int i = 0; i < count; i++)
+    {
+        char name[256], generatorName[16];
+        unsigned seed;
+        snprintf(name, sizeof(name), "%.*s", (int)strlen(entries[i]->d_name) - 5, entries[i]->d_name);
+        free(entries[i]);
+        if (sscanf(name, "%15[a-z]-%u", generatorName, &seed) != 2 ||
+            (strcmp(generatorName, "classic") != 0 && strcmp(generatorName, "bsp") != 0))
         {
-            int collected = 0;
-            if (cell == GOLD_ICON)
-                collected = GOLD_VALUE;
-            else if (cell == BLACK_GOLD_ICON)
-                collected = BLACK_GOLD_VALUE;
-            playerGold += collected;
-            show_gold_message(playerGold);
-            // hazf tala az rooye zamin (jaygozari kaf)
-            map[newY][newX] = FLOOR;
+            printf("  %-16s not GENERATOR-SEED\n", name);
+            failed++;
+            continue;
         }
-        else if (cell == FOOD_ICON)
+        if (!checkRecordedGame(dirName, name, strcmp(generatorName, "bsp") == 0 ? GEN_BSP : GEN_CLASSIC, seed))
+            failed++;
+    }
+    free(entries);
+    exit(failed > 0 || count == 0 ? 2 : 0);
+}
+
+// Usage: game3.out [--headless] [--realtime] [--seed N]
+// --headless draws into memory instead of a terminal, reads the keys from
+// stdin and writes every frame to stdout, e.g.
+//   printf 'iq\033[Cq' | ./game3.out --headless --seed 1 > frames.txt
+// Two runs with the same seed and keys give byte-identical frames.
+// --realtime runs the world on a 10 Hz clock (ignored when headless, since
+// there is no clock to follow there).
+// --bot NAME [--max-turns N] lets a bot play one game headless and prints a
+// line of results, e.g.
+//   for s in $(seq 1000); do ./game3.out --bot greedy --seed $s; done
+// --simulate N [--jobs J] plays N games with the bot (greedy by default) on
+// J cores (all by default), seeds counting up from --seed, and prints totals.
+// --check-levels N [--jobs J] builds and validates N levels (see LEVEL CHECK).
+// --check-viewport scrolls a small view over a level and checks what it
+// shows (see VIEWPORT CHECK).
+// --check-frames DIR plays the games recorded in DIR again and diffs the
+// frames with the recorded ones (see FRAME CHECK), e.g.
+//   ./game3.out --check-frames frames
+// --generator bsp switches to the BSP level generator (see BSP GENERATOR).
+// --floor-cache KB keeps that much of the floors left behind in memory
+// before moving them to disk (see FLOOR CACHE).
+// --overworld [--world-dir DIR] plays in one endless world instead of the
+// floors (see OVERWORLD); with DIR the explored world is kept there.
+// --fov-radius N sets how far the player sees (see FIELD OF VIEW).
+int main(int argc, char **argv)
+{
+    unsigned seed = (unsigned)time(NULL);
+    long simulateGames = 0, checkCount = 0;
+    int simulateJobs = 0;
+    bool checkView = false;
+    const char *framesDir = NULL;
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+            headless = true;
+        else if (strcmp(argv[i], "--realtime") == 0)
+            realTime = true;
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            seed = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--bot") == 0 && i + 1 < argc)
         {
-            if (foodCount < MAX_FOOD_ITEMS)
+            activeBot = findBot(argv[++i]);
+            if (!activeBot)
             {
-                foodInventory[foodCount++] = (Food){newX, newY, COMMON_FOOD, COMMON_FOOD_HEALTH_RESTORE};
-                map[newY][newX] = FLOOR;
+                fprintf(stderr, "no such bot: %s\n", argv[i]);
+                return 1;
             }
+            headless = true;
+            drawFrames = false;
+            keySource = botKey;
         }
-        else
-        {
-            collectItem(map, newX, newY);
-        }
-
-        int rIndex = roomIndexAt(room_count, rooms, playerX, playerY); // Declare rIndex here
-
-        for (int i = 0; i < enemyCount; i++)
+        else if (strcmp(argv[i], "--max-turns") == 0 && i + 1 < argc)
+            botMaxTurns = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--simulate") == 0 && i + 1 < argc)
+            simulateGames = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--generator") == 0 && i + 1 < argc)
         {
-            if (isEnemyInRoom(&enemies[i], rooms[rIndex]))
-            {
-                enemies[i].isActive = 1;
-                moveEnemyTowardsPlayer(&enemies[i], playerX, playerY, map);
-            }
+            i++;
+            if (strcmp(argv[i], "bsp") == 0)
+                levelGenerator = GEN_BSP;
+            else if (strcmp(argv[i], "classic") == 0)
+                levelGenerator = GEN_CLASSIC;
             else
             {
-                enemies[i].isActive = 0;
+                fprintf(stderr, "no such generator: %s\n", argv[i]);
+                return 1;
             }
         }
-
-        for (int i = 0; i < enemyCount; i++)
+        else if (strcmp(argv[i], "--check-levels") == 0 && i + 1 < argc)
+            checkCount = strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--check-viewport") == 0)
+            checkView = true;
+        else if (strcmp(argv[i], "--check-frames") == 0 && i + 1 < argc)
+            framesDir = argv[++i];
+        else if (strcmp(argv[i], "--fov-radius") == 0 && i + 1 < argc)
+            fovRadius = (int)strtol(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--overworld") == 0)
+            overworld = true;
+        else if (strcmp(argv[i], "--world-dir") == 0 && i + 1 < argc)
         {
-            if (enemies[i].isActive && enemies[i].x == playerX && enemies[i].y == playerY)
-            {
-                processCombat(&player, &enemies[i], weaponInventory[0].damage); // Use the first weapon's damage
-            }
+            overworld = true;
+            snprintf(worldDir, sizeof(worldDir), "%s", argv[++i]);
         }
-
-        printDungeon(map, visible, rooms, room_count);
+        else if (strcmp(argv[i], "--floor-cache") == 0 && i + 1 < argc)
+            floorCacheBudget = strtoul(argv[++i], NULL, 10) * 1024;
+        else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+            simulateJobs = (int)strtol(argv[++i], NULL, 10);
+    }
+    initFieldOfView(fovRadius);
+    if (checkCount > 0)
+        checkLevels(checkCount, simulateJobs > 0 ? simulateJobs : (int)sysconf(_SC_NPROCESSORS_ONLN), seed);
+    if (checkView)
+        checkViewport(seed);
+    if (framesDir)
+        checkFrames(framesDir);
+    if (simulateGames > 0)
+    {
+        if (!activeBot)
+            activeBot = findBot("greedy");
+        headless = true;
+        drawFrames = false;
+        keySource = botKey;
+        if (simulateJobs <= 0)
+            simulateJobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+        runSimulation(simulateGames, simulateJobs, seed);
     }
+    if (headless)
+        realTime = false;
 
-    display_final_score();
+    if (!headless)
+    {
+        initscr();
+        keypad(stdscr, TRUE);
+        noecho();
+        curs_set(0);
 
-    // Cleanup ncurses
-    endwin();
-    return 0;
+        if (has_colors() == FALSE)
+        {
+            endwin();
+            printf("sistem shoma az rang poshtibani nemikonad\n");
+            exit(1);
+        }
+        start_color();
+        init_pair(1, COLOR_YELLOW, COLOR_BLACK); // talaye adi
+        init_pair(2, COLOR_RED, COLOR_BLACK);    // talaye siyah
+        init_pair(PAIR_ENEMY, COLOR_MAGENTA, COLOR_BLACK);
+        init_pair(PAIR_FOOD, COLOR_GREEN, COLOR_BLACK);
+    }
+    else if (drawFrames)
+        frameOut = stdout;
+
+    return playGame(seed);
 }
 
 void displayMessage(const char *message)
 {
-    mvprintw(MAP_HEIGHT + 1, 0, "%s", message);
-    refresh();
-    napms(1000);
-    move(MAP_HEIGHT + 1, 0);
-    clrtoeol();
+    if (realTime)
+    {
+        setMessage("%s", message); // stays up until the next key instead
+        return;
+    }
+    showMessageNow(message, 0);
+    waitMs(1000);
+    showMessageNow(messageLine, 0);
 }